@@ -0,0 +1,77 @@
+// Per-operation latency while rebuilds run, for the three rebuild modes of
+// src/Generic/bahnasy_generic_version.cpp: at once (rebuild() on the calling
+// thread), incremental (max_rebuild_work_per_op) and background_rebuild.
+// An operation is timed in the calling thread's CPU time, so neither the
+// worker thread nor the host preempting the caller shows up in it.
+//
+// Build & run (repo root):
+//   g++ -std=c++17 -O2 -pthread Benchmarks/micro/rebuild_latency.cpp -o rebuild_latency
+//   ./rebuild_latency [n = 4194304] [ops = 300000]
+
+#define BAHNASY_NO_MAIN
+#include "../../src/Generic/bahnasy_generic_version.cpp"
+
+using namespace bahnasy;
+
+static volatile long long rebuild_sink = 0;
+
+static double thread_us() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Inserts clustered around a moving spot (they deepen one path until a
+// rebuild is due), random erases (every 16384 of them start a rebuild) and
+// random point sets and queries in between.
+static void run(const char* name, int n, int ops, BahnasyTree<SumAddPolicy>::Config cfg) {
+    mt19937 rng(7);
+    vector<long long> a(n);
+    for (auto& x : a) x = rng() % 1000;
+    BahnasyTree<SumAddPolicy> tr(a, cfg);
+
+    vector<double> lat(ops);
+    int spot = 1;
+    long long sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < ops; ++i) {
+        if (i % 4096 == 0) spot = 1 + (int)(rng() % tr.size());
+        int op = (int)(rng() % 8);
+        int p = 1 + (int)(rng() % tr.size());
+        double t0 = thread_us();
+        if (op < 3) tr.insert_at(spot + (int)(rng() % 8), (long long)(rng() % 1000));
+        else if (op < 5) tr.erase_at(p);
+        else if (op < 7) tr.point_set(p, (long long)(rng() % 1000));
+        else sum += tr.range_query(p, min(tr.size(), p + 1000));
+        lat[i] = thread_us() - t0;
+    }
+    double total = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    rebuild_sink = rebuild_sink + sum + tr.range_query(1, tr.size());
+
+    sort(lat.begin(), lat.end());
+    auto pct = [&](double q) { return lat[min(ops - 1, (int)(q * ops))]; };
+    printf("%-22s %10.1fms %9.2fus %9.2fus %9.2fus %10.1fus %10.1fus\n", name, total, pct(0.5), pct(0.99),
+           pct(0.999), pct(0.9999), lat.back());
+}
+
+int main(int argc, char** argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 1 << 22;
+    int ops = argc > 2 ? atoi(argv[2]) : 300000;
+
+    printf("n = %d, %d operations\n", n, ops);
+    printf("%-22s %12s %11s %11s %11s %12s %12s\n", "mode", "total", "p50", "p99", "p99.9", "p99.99", "max");
+    for (int k : {0, 256, 4096}) {
+        BahnasyTree<SumAddPolicy>::Config cfg;
+        cfg.rebuild_after_erases = 16384;
+        cfg.max_rebuild_work_per_op = k;
+        char name[64];
+        snprintf(name, sizeof name, k ? "incremental K=%d" : "at once", k);
+        run(name, n, ops, cfg);
+    }
+    BahnasyTree<SumAddPolicy>::Config cfg;
+    cfg.rebuild_after_erases = 16384;
+    cfg.background_rebuild = true;
+    run("background", n, ops, cfg);
+    printf("checksum: %lld\n", (long long)rebuild_sink);
+    return 0;
+}
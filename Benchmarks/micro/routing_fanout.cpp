@@ -0,0 +1,72 @@
+// Routing latency vs. fanout T for the child-routing kernels in
+// src/Generic/bahnasy_generic_version.cpp.
+//
+// Build & run (repo root):
+//   g++ -std=c++17 -O2 Benchmarks/micro/routing_fanout.cpp -o routing_fanout && ./routing_fanout
+
+#define BAHNASY_NO_MAIN
+#include "../../src/Generic/bahnasy_generic_version.cpp"
+
+using namespace bahnasy;
+
+// The routing loops the tree used before the vectorized kernels.
+static int route_linear_early_exit(const int* prefix, int n, int i) {
+    for (int k = 1; k <= n; ++k)
+        if (prefix[k] >= i) return k - 1;
+    return n - 1;
+}
+
+static int route_branchy_binary(const int* prefix, int n, int i) {
+    int l = 0, r = n;
+    while (l + 1 < r) {
+        int m = (l + r) >> 1;
+        if (prefix[m] < i) l = m;
+        else r = m;
+    }
+    return l;
+}
+
+// Every chain ends up here, so the compiler cannot drop the routing loops.
+static volatile int route_sink = 0;
+
+template <class F>
+static double ns_per_route(const vector<int>& prefix, const vector<int>& queries, F route) {
+    int n = (int)prefix.size() - 1;
+    // Each route depends on the previous result (r >> 30 is always 0), so this
+    // measures latency, like the root-to-leaf descent does, not throughput.
+    int r = 0;
+    auto t0 = chrono::steady_clock::now();
+    for (int rep = 0; rep < 8; ++rep)
+        for (int q : queries) r = route(prefix.data(), n, q + (r >> 30));
+    auto t1 = chrono::steady_clock::now();
+    route_sink = route_sink + r;
+    return chrono::duration<double, nano>(t1 - t0).count() / (8.0 * queries.size());
+}
+
+int main() {
+    mt19937 rng(123);
+    const int Q = 1 << 20;
+
+    printf("simd level: %d (0 = scalar, 1 = avx2, 2 = avx512)\n", (int)simd::level());
+    printf("%6s %14s %14s %14s %14s\n", "T", "linear(old)", "binary(old)", "simd-count", "branchless");
+
+    for (int T : {4, 8, 16, 24, 32, 48, 64, 96, 128, 256, 512, 1024}) {
+        vector<int> prefix(T + 1, 0);
+        for (int k = 1; k <= T; ++k) prefix[k] = prefix[k - 1] + 1 + (int)(rng() % 64);
+
+        vector<int> queries(Q);
+        for (auto& q : queries) q = 1 + (int)(rng() % prefix[T]);
+
+        double a = ns_per_route(prefix, queries, route_linear_early_exit);
+        double b = ns_per_route(prefix, queries, route_branchy_binary);
+        double c = ns_per_route(prefix, queries, [](const int* p, int n, int i) {
+            return routing::count_less(p + 1, n - 1, i);
+        });
+        double d = ns_per_route(prefix, queries, [](const int* p, int n, int i) {
+            return routing::branchless_lower_bound(p + 1, n - 1, i);
+        });
+        printf("%6d %12.2fns %12.2fns %12.2fns %12.2fns\n", T, a, b, c, d);
+    }
+    printf("checksum: %d\n", (int)route_sink);
+    return 0;
+}
@@ -0,0 +1,162 @@
+// Stress test for Config::concurrent_reads: one writer thread runs a random mix
+// of inserts, erases and other writes (and checks itself against a plain
+// vector), while reader threads call concurrent_query on fixed ranges. Every
+// answer must equal the range's value at some moment between the read's start
+// and end: the writer records the ranges' values after each step before it
+// touches the tree, so a read may land on any step from the last finished one
+// to the last recorded one. The split_at-then-concat step is two writes, and
+// the prefix the tree holds between them is recorded as a state of its own.
+//
+// Build & run (repo root); exits non-zero on a mismatch:
+//   g++ -std=c++17 -O2 -pthread Benchmarks/stress/concurrent_reads.cpp -o concurrent_reads && ./concurrent_reads
+// Under sanitizers (the readers are a seqlock: their racy copies are expected,
+// see tsan.supp):
+//   g++ -std=c++17 -O1 -g -fsanitize=address -pthread Benchmarks/stress/concurrent_reads.cpp -o cr_asan
+//   g++ -std=c++17 -O1 -g -fsanitize=thread -pthread Benchmarks/stress/concurrent_reads.cpp -o cr_tsan
+//   TSAN_OPTIONS="suppressions=Benchmarks/stress/tsan.supp history_size=7" ./cr_tsan
+// Arguments: [seeds = 4] [writes per seed = 20000] [readers = 3]
+
+#define BAHNASY_NO_MAIN
+#include "../../src/Generic/bahnasy_generic_version.cpp"
+
+using namespace bahnasy;
+
+template <class P>
+static bool run(uint64_t seed, int writes, int readers, int threshold) {
+    using Tree = BahnasyTree<P>;
+    mt19937_64 rng(seed);
+    typename Tree::Config cfg;
+    cfg.concurrent_reads = true;
+    cfg.leaf_threshold = threshold;
+    cfg.background_rebuild = rng() % 2;
+    cfg.max_rebuild_work_per_op = rng() % 2 ? 0 : 17;
+    cfg.rebuild_after_erases = rng() % 2 ? -1 : 30;
+
+    vector<typename P::Agg> a(1500);
+    for (auto& x : a) x = rng() % 1000;
+    Tree tr(a, cfg);
+
+    // Probed ranges: some short (inside a block or two), some wide.
+    const int K = 8;
+    int pl[K], pr[K];
+    for (int i = 0; i < K; ++i) {
+        pl[i] = rng() % 400 + 1;
+        pr[i] = pl[i] + rng() % (i < 4 ? 20 : 600);
+    }
+    // States the readers may see, from 1 on: the start, then one per step (two
+    // for the split-and-concat step, whose tree holds only a prefix in between).
+    vector<array<typename P::Agg, K>> hist(2 * writes + 2);
+    atomic<int> done{0}, recorded{0};
+    int state = 0;
+    auto record = [&](int len) { // the probes over a cut to its first len values
+        auto& h = hist[state + 1];
+        for (int i = 0; i < K; ++i) {
+            typename P::Agg e = P::AGG_ID;
+            for (int j = pl[i]; j <= min({pr[i], len, (int)a.size()}); ++j) e = P::combine(e, a[j - 1]);
+            h[i] = e;
+        }
+        recorded.store(++state, memory_order_release);
+    };
+    record((int)a.size());
+    done.store(state, memory_order_release);
+
+    atomic<bool> stop{false};
+    atomic<long> bad{0}, reads{0};
+    vector<thread> ts;
+    for (int t = 0; t < readers; ++t) {
+        ts.emplace_back([&, t] {
+            mt19937 r2(t * 77 + 1);
+            while (!stop.load()) {
+                int i = r2() % K;
+                int from = done.load(memory_order_acquire);
+                auto got = tr.concurrent_query(pl[i], pr[i]);
+                int to = recorded.load(memory_order_acquire);
+                bool ok = false;
+                for (int k = from; k <= to && !ok; ++k) ok = hist[k][i] == got;
+                if (!ok) ++bad;
+                ++reads;
+            }
+        });
+    }
+
+    for (int it = 1; it <= writes; ++it) {
+        int sz = (int)a.size();
+        int op = rng() % 9;
+        int l = rng() % sz + 1, r = rng() % sz + 1;
+        if (l > r) swap(l, r);
+        function<void()> write; // the same step on the tree, run once it is recorded
+        int cut = INT_MAX;      // how much of a the tree holds once write's first call returns
+        if (op == 0) {
+            auto v = rng() % 1000;
+            a[l - 1] = v;
+            write = [&, l, v] { tr.point_set(l, v); };
+        } else if (op == 1) {
+            auto d = rng() % 50;
+            if (rng() % 2) r = min(sz, l + (int)(rng() % 30));
+            for (int i = l; i <= r; ++i) a[i - 1] = P::apply(a[i - 1], d, 1);
+            write = [&, l, r, d] { tr.range_apply(l, r, d); };
+        } else if (op <= 3) {
+            auto v = rng() % 1000;
+            int p = rng() % (sz + 1) + 1;
+            a.insert(a.begin() + p - 1, v);
+            write = [&, p, v] { tr.insert_at(p, v); };
+        } else if (op <= 5) {
+            if (sz > 1000) {
+                a.erase(a.begin() + l - 1);
+                write = [&, l] { tr.erase_at(l); };
+            }
+        } else if (op == 6) {
+            r = min(sz, l + (int)(rng() % 40));
+            reverse(a.begin() + l - 1, a.begin() + r);
+            write = [&, l, r] { tr.range_reverse(l, r); };
+        } else if (op == 7) {
+            if (rng() % 4 == 0) {
+                int k = rng() % (sz - 1) + 1;
+                cut = k;
+                write = [&, k] {
+                    Tree rest = tr.split_at(k);
+                    done.store(state, memory_order_release);
+                    record((int)a.size());
+                    tr.concat(std::move(rest));
+                };
+            } else {
+                write = [&, l, r] { tr.range_query(l, r); };
+            }
+        } else {
+            int k = rng() % 30;
+            if (sz > 2500) {
+                a.erase(a.begin() + l - 1, a.begin() + min(sz, l + k - 1));
+                write = [&, l, k] { tr.erase_range(l, l + k - 1); };
+            } else {
+                vector<typename P::Agg> v(k);
+                for (auto& x : v) x = rng() % 1000;
+                a.insert(a.begin() + l - 1, v.begin(), v.end());
+                write = [&, l, v] { tr.insert_range(l, v); };
+            }
+        }
+        record(cut);
+        if (write) write();
+        done.store(state, memory_order_release);
+        if (it % 64 == 0) this_thread::yield();
+    }
+    stop = true;
+    for (auto& t : ts) t.join();
+
+    bool ok = bad.load() == 0 && tr.to_vector() == a;
+    printf("seed %llu: %ld reads, %ld bad%s\n", (unsigned long long)seed, reads.load(), bad.load(),
+           tr.to_vector() == a ? "" : ", final sequence differs");
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int seeds = argc > 1 ? atoi(argv[1]) : 4;
+    int writes = argc > 2 ? atoi(argv[2]) : 20000;
+    int readers = argc > 3 ? atoi(argv[3]) : 3;
+    bool ok = true;
+    for (int s = 1; s <= seeds; ++s) {
+        ok &= run<SumAddPolicy>(s, writes, readers, s % 3 == 0 ? 3 : 7);
+        ok &= run<MinAddPolicy>(s + 100, writes, readers, 5);
+    }
+    puts(ok ? "concurrent_reads OK" : "concurrent_reads FAILED");
+    return ok ? 0 : 1;
+}
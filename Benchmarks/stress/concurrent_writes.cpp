@@ -0,0 +1,250 @@
+// Stress test for Config::concurrent_writes. Writer threads run point_set and
+// range_apply under the shared lock while a side thread keeps reading through
+// range_query, snapshots, const range_query and one-query batches (all of them
+// hold the tree; the non-const ones redo the aggregates the latched writes left
+// stale, the const one reads through them).
+//   Phase 1: each writer owns a slice of the sequence and mixes point sets and
+//            range applies inside it, so its own vector slice is the model.
+//   Phase 2: every writer range-applies anywhere; adds commute, so the model
+//            is the start sequence plus the sum of all writers' difference
+//            arrays.
+// Then the tree must equal the model, element by element and on random ranges.
+// Separately, the two halves of a split_at are written from two threads at
+// once (each against its own vector), one of them after a concat that links
+// a third tree's still shared arena; then they are joined again and compared.
+// Last, one half of a split dies (its snapshot after it) while the other is
+// written.
+//
+// Build & run (repo root); exits non-zero on a mismatch:
+//   g++ -std=c++17 -O2 -pthread Benchmarks/stress/concurrent_writes.cpp -o concurrent_writes && ./concurrent_writes
+// Under sanitizers:
+//   g++ -std=c++17 -O1 -g -fsanitize=address -pthread Benchmarks/stress/concurrent_writes.cpp -o cw_asan
+//   g++ -std=c++17 -O1 -g -fsanitize=thread -pthread Benchmarks/stress/concurrent_writes.cpp -o cw_tsan
+// Arguments: [seeds = 4] [writes per thread = 20000]
+
+#define BAHNASY_NO_MAIN
+#include "../../src/Generic/bahnasy_generic_version.cpp"
+
+using namespace bahnasy;
+
+template <class P>
+static bool run(uint64_t seed, int n, int writers, int writes, int threshold) {
+    using Tree = BahnasyTree<P>;
+    using B = typename Tree::BatchOp;
+    mt19937_64 rng(seed);
+    typename Tree::Config cfg;
+    cfg.concurrent_writes = true;
+    cfg.leaf_threshold = threshold;
+
+    vector<typename P::Agg> a(n);
+    for (auto& x : a) x = rng() % 1000;
+    Tree tr(a, cfg);
+
+    atomic<bool> stop{false};
+    thread side([&] {
+        mt19937 r(seed);
+        vector<typename Tree::Snapshot> snaps;
+        while (!stop) {
+            int l = r() % n + 1, rr = r() % n + 1;
+            if (l > rr) swap(l, rr);
+            switch (r() % 4) {
+            case 0: (void)tr.range_query(l, rr); break;
+            case 1:
+                if (snaps.size() < 6) snaps.push_back(tr.snapshot());
+                else (void)snaps[r() % 6].range_query(l, rr);
+                break;
+            case 2: {
+                vector<B> batch{B{B::RangeQuery, l, rr, 0, 0}};
+                (void)tr.apply_batch(batch);
+                break;
+            }
+            default: (void)static_cast<const Tree&>(tr).range_query(l, rr);
+            }
+            this_thread::yield();
+        }
+    });
+
+    // Phase 1: writer t owns [lo, hi) (0-indexed).
+    vector<thread> ts;
+    for (int t = 0; t < writers; ++t) {
+        ts.emplace_back([&, t] {
+            mt19937_64 r(seed * 31 + t);
+            int lo = (long long)n * t / writers, hi = (long long)n * (t + 1) / writers;
+            for (int i = 0; i < writes; ++i) {
+                int l = lo + r() % (hi - lo), rr = lo + r() % (hi - lo);
+                if (l > rr) swap(l, rr);
+                if (r() % 8 == 0) l = lo, rr = hi - 1;
+                if (r() % 2) {
+                    auto v = r() % 1000;
+                    tr.point_set(l + 1, v);
+                    a[l] = v;
+                } else {
+                    auto d = r() % 50;
+                    if (r() % 2) rr = min(hi - 1, l + (int)(r() % 40));
+                    tr.range_apply(l + 1, rr + 1, d);
+                    for (int j = l; j <= rr; ++j) a[j] = P::apply(a[j], d, 1);
+                }
+            }
+        });
+    }
+    for (auto& t : ts) t.join();
+    ts.clear();
+
+    // Phase 2: range applies anywhere, recorded per writer as difference arrays.
+    vector<vector<typename P::Lazy>> diff(writers, vector<typename P::Lazy>(n + 1));
+    for (int t = 0; t < writers; ++t) {
+        ts.emplace_back([&, t] {
+            mt19937_64 r(seed * 77 + t);
+            for (int i = 0; i < writes; ++i) {
+                int l = r() % n, rr = r() % n;
+                if (l > rr) swap(l, rr);
+                if (r() % 3) rr = min(n - 1, l + (int)(r() % 300));
+                auto d = r() % 50;
+                tr.range_apply(l + 1, rr + 1, d);
+                diff[t][l] += d;
+                diff[t][rr + 1] -= d;
+            }
+        });
+    }
+    for (auto& t : ts) t.join();
+    stop = true;
+    side.join();
+
+    typename P::Lazy added = 0;
+    for (int i = 0; i < n; ++i) {
+        for (int t = 0; t < writers; ++t) added += diff[t][i];
+        a[i] = P::apply(a[i], added, 1);
+    }
+    // The const reads come first: they read through whatever aggregates the
+    // last latched writes left stale, where the other range_query redoes them.
+    const Tree& ctr = tr;
+    if (ctr.to_vector() != a) {
+        printf("seed %llu: to_vector MISMATCH\n", (unsigned long long)seed);
+        return false;
+    }
+    for (int q = 0; q < 2000; ++q) {
+        int l = rng() % n + 1, r = rng() % n + 1;
+        if (l > r) swap(l, r);
+        typename P::Agg e = P::AGG_ID;
+        for (int i = l; i <= r; ++i) e = P::combine(e, a[i - 1]);
+        if ((q < 1000 ? ctr.range_query(l, r) : tr.range_query(l, r)) != e) {
+            printf("seed %llu: range_query(%d, %d) MISMATCH\n", (unsigned long long)seed, l, r);
+            return false;
+        }
+    }
+    printf("seed %llu ok\n", (unsigned long long)seed);
+    return true;
+}
+
+// Random inserts, erases, point sets and range applies on t, mirrored in v.
+template <class P>
+static void write_randomly(BahnasyTree<P>& t, vector<typename P::Agg>& v, uint64_t s, int writes) {
+    mt19937_64 r(s);
+    for (int i = 0; i < writes; ++i) {
+        int sz = (int)v.size(), op = r() % 4;
+        if (sz < 2) op = 0;
+        int p = sz ? (int)(r() % sz) + 1 : 1;
+        if (op == 0) {
+            auto x = r() % 1000;
+            t.insert_at(p, x);
+            v.insert(v.begin() + p - 1, x);
+        } else if (op == 1) {
+            t.erase_at(p);
+            v.erase(v.begin() + p - 1);
+        } else if (op == 2) {
+            auto x = r() % 1000;
+            t.point_set(p, x);
+            v[p - 1] = x;
+        } else {
+            int q = (int)(r() % sz) + 1;
+            auto d = r() % 50;
+            t.range_apply(min(p, q), max(p, q), d);
+            for (int k = min(p, q); k <= max(p, q); ++k) v[k - 1] = P::apply(v[k - 1], d, 1);
+        }
+    }
+}
+
+// Split halves are separate trees; concurrent_writes is not needed for them.
+template <class P>
+static bool run_split_halves(uint64_t seed, int n, int writes) {
+    using Tree = BahnasyTree<P>;
+    using Vec = vector<typename P::Agg>;
+    mt19937_64 rng(seed);
+    Vec a(n);
+    for (auto& x : a) x = rng() % 1000;
+    Tree left(a);
+    Tree right = left.split_at(n / 2);
+    Vec va(a.begin(), a.begin() + n / 2), vb(a.begin() + n / 2, a.end());
+
+    // right takes nodes of an arena that other_tail keeps shared.
+    Vec extra(n / 4);
+    for (auto& x : extra) x = rng() % 1000;
+    Tree other(extra);
+    Tree other_tail = other.split_at((int)extra.size() / 2);
+    right.concat(std::move(other));
+    vb.insert(vb.end(), extra.begin(), extra.begin() + extra.size() / 2);
+
+    thread tl(write_randomly<P>, ref(left), ref(va), seed * 2, writes);
+    thread tr(write_randomly<P>, ref(right), ref(vb), seed * 2 + 1, writes);
+    tl.join();
+    tr.join();
+    left.concat(std::move(right));
+    va.insert(va.end(), vb.begin(), vb.end());
+    if (left.to_vector() != va) {
+        printf("seed %llu: split halves MISMATCH\n", (unsigned long long)seed);
+        return false;
+    }
+    printf("seed %llu: split halves ok\n", (unsigned long long)seed);
+    return true;
+}
+
+// The first half of a split dies, and then its last snapshot is dropped, on
+// one thread while the other half keeps writing nodes of the first half's
+// arena on another.
+template <class P>
+static bool run_partner_exit(uint64_t seed, int n, int writes) {
+    using Tree = BahnasyTree<P>;
+    using Vec = vector<typename P::Agg>;
+    mt19937_64 rng(seed);
+    Vec a(n);
+    for (auto& x : a) x = rng() % 1000;
+    Tree left(a);
+    Tree right = left.split_at(n / 2);
+    Vec va(a.begin(), a.begin() + n / 2), vb(a.begin() + n / 2, a.end());
+
+    bool left_ok = true;
+    thread tl([&] {
+        Vec before = va;
+        auto snap = left.snapshot();
+        write_randomly<P>(left, va, seed * 2, writes / 2);
+        left_ok = left.to_vector() == va;
+        Tree gone = std::move(left);
+        gone = Tree();
+        left_ok = left_ok && snap.to_vector() == before;
+    });
+    thread tr(write_randomly<P>, ref(right), ref(vb), seed * 2 + 1, writes);
+    tl.join();
+    tr.join();
+    if (!left_ok || right.to_vector() != vb) {
+        printf("seed %llu: partner exit MISMATCH\n", (unsigned long long)seed);
+        return false;
+    }
+    printf("seed %llu: partner exit ok\n", (unsigned long long)seed);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int seeds = argc > 1 ? atoi(argv[1]) : 4;
+    int writes = argc > 2 ? atoi(argv[2]) : 20000;
+    bool ok = true;
+    // Phase 2 sums the writers' adds, so only policies whose lazy tags add up.
+    for (int s = 1; s <= seeds && ok; ++s) {
+        ok = run<SumAddPolicy>(s, 50000 + s * 1000, 4, writes, s % 2 ? 7 : -1) &&
+             run<MinAddPolicy>(s + 100, 3000, 3, writes, 3) &&
+             run<SumAddPolicy>(s + 200, 20000, 4, writes, 6) &&
+             run_split_halves<SumAddPolicy>(s + 300, 20000, writes) &&
+             run_partner_exit<SumAddPolicy>(s + 400, 20000, writes);
+    }
+    puts(ok ? "concurrent_writes OK" : "FAIL");
+    return ok ? 0 : 1;
+}
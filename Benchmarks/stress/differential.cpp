@@ -0,0 +1,349 @@
+// Differential fuzzer for src/Generic/bahnasy_generic_version.cpp: random
+// operation sequences run on a BahnasyTree and on a plain vector, and every
+// answer (and, every so often, the whole sequence) must agree. Each round
+// draws a random Config (leaf threshold, height slack, rebuild modes, apply
+// buffer, concurrent_reads / concurrent_writes, batch_threads) and runs every
+// bundled policy plus HashAddPolicy (order-sensitive, no block kernel), with
+// the round's fanout and with a few fixed ones. Snapshots
+// taken along the way are checked against the vector they were taken from.
+//
+// Covered: point_set, range_query (and concurrent_query), range_apply,
+// insert_at, erase_at, insert_range, erase_range, insert_many, range_reverse,
+// apply_batch, split_at and concat (both ways round), snapshot, and a split
+// half outliving the trees whose nodes were concatenated onto the other half.
+//
+// Build & run (repo root); prints the round and step of the first mismatch
+// and exits non-zero:
+//   g++ -std=c++17 -O2 -pthread Benchmarks/stress/differential.cpp -o differential && ./differential
+// Under sanitizers:
+//   g++ -std=c++17 -O1 -g -fsanitize=address,undefined -pthread Benchmarks/stress/differential.cpp -o diff_asan
+//   g++ -std=c++17 -O1 -g -fsanitize=thread -pthread Benchmarks/stress/differential.cpp -o diff_tsan
+// Arguments: [rounds = 50] [steps per tree = 3000] [seed = 12345]
+
+#define BAHNASY_NO_MAIN
+#include "../../src/Generic/bahnasy_generic_version.cpp"
+
+using namespace bahnasy;
+
+// Order-sensitive and without a BLOCK_KERNEL, so it takes the reverse(Agg)
+// paths and the scalar BlockOps: a polynomial hash (mod 2^64) of the sequence
+// read forwards and backwards. pw is BASE^len and geo the sum of BASE^k for
+// k < len, which is what an add to every element adds to either hash.
+constexpr unsigned long long HASH_BASE = 1000003;
+
+struct HashAgg {
+    unsigned long long fwd = 0, bwd = 0, pw = 1, geo = 0;
+    constexpr HashAgg() = default;
+    constexpr HashAgg(long long x) : fwd(x), bwd(x), pw(HASH_BASE), geo(1) {}
+    bool operator==(const HashAgg& o) const { return fwd == o.fwd && bwd == o.bwd && pw == o.pw && geo == o.geo; }
+    bool operator!=(const HashAgg& o) const { return !(*this == o); }
+};
+
+struct HashAddPolicy {
+    using Agg  = HashAgg;
+    using Lazy = long long;
+
+    static constexpr Agg  AGG_ID{};
+    static constexpr Lazy LAZY_ID = 0;
+
+    static Agg combine(Agg a, Agg b) {
+        Agg c;
+        c.fwd = a.fwd * b.pw + b.fwd;
+        c.bwd = b.bwd * a.pw + a.bwd;
+        c.pw = a.pw * b.pw;
+        c.geo = a.geo * b.pw + b.geo;
+        return c;
+    }
+    static Agg apply(Agg a, Lazy add, int /*len*/) {
+        a.fwd += (unsigned long long)add * a.geo;
+        a.bwd += (unsigned long long)add * a.geo;
+        return a;
+    }
+    static Lazy compose(Lazy cur, Lazy add) { return cur + add; }
+    static Agg reverse(Agg a) {
+        swap(a.fwd, a.bwd);
+        return a;
+    }
+};
+
+static mt19937_64 rng;
+static int round_no = 0;
+
+static bool mismatch(const char* what, const char* policy, int fanout, int step) {
+    printf("%s MISMATCH: round %d, %s, fanout %d, step %d\n", what, round_no, policy, fanout, step);
+    return false;
+}
+
+template <class P>
+static typename P::Agg fold(const vector<typename P::Agg>& a, int l, int r) {
+    typename P::Agg e = P::AGG_ID;
+    for (int i = max(l, 1); i <= min(r, (int)a.size()); ++i) e = P::combine(e, a[i - 1]);
+    return e;
+}
+
+template <class P>
+static void add(vector<typename P::Agg>& a, int l, int r, typename P::Lazy d) {
+    for (int i = max(l, 1); i <= min(r, (int)a.size()); ++i) a[i - 1] = P::apply(a[i - 1], d, 1);
+}
+
+template <class P>
+static bool run(const char* policy, int steps, int threshold, int maxn) {
+    using Tree = BahnasyTree<P>;
+    using Vec = vector<typename P::Agg>;
+    using B = typename Tree::BatchOp;
+
+    typename Tree::Config cfg;
+    if (threshold > 0) cfg.leaf_threshold = threshold;
+    cfg.height_slack = rng() % 3;
+    cfg.max_spf = 5000;
+    if (rng() % 2) cfg.rebuild_after_erases = rng() % 20 + 1;
+    {
+        int w[] = {0, 1, 3, 17, 100};
+        cfg.max_rebuild_work_per_op = w[rng() % 5];
+    }
+    cfg.background_rebuild = rng() % 3 == 0;
+    {
+        int b[] = {0, 1, 2, 8};
+        cfg.apply_buffer_size = b[rng() % 4];
+    }
+    cfg.concurrent_reads = rng() % 3 == 0;
+    cfg.concurrent_writes = rng() % 3 == 0;
+    {
+        int t[] = {1, 2, 3, 8};
+        cfg.batch_threads = t[rng() % 4];
+    }
+
+    Vec a(rng() % maxn + 1);
+    for (auto& x : a) x = rng() % 1000;
+    Tree tr(a, cfg);
+    int bias = rng() % 3; // 0 uniform, 1 erase-heavy, 2 insert-heavy
+    int hot_l = 1, hot_r = 1; // a range re-applied now and then (fills the apply buffer)
+
+    vector<pair<typename Tree::Snapshot, Vec>> snaps;
+    auto check_snaps = [&](int step) {
+        for (auto& [snap, v] : snaps) {
+            if (snap.size() != (int)v.size() || snap.to_vector() != v)
+                return mismatch("snapshot", policy, threshold, step);
+            int m = (int)v.size();
+            if (!m) continue;
+            int l = rng() % m + 1, r = rng() % m + 1;
+            if (l > r) swap(l, r);
+            if (snap.range_query(l, r) != fold<P>(v, l, r)) return mismatch("snapshot query", policy, threshold, step);
+        }
+        return true;
+    };
+
+    for (int step = 0; step < steps; ++step) {
+        if (rng() % 25 == 0) {
+            if (snaps.size() >= 4) snaps.erase(snaps.begin() + rng() % snaps.size());
+            if (rng() % 4 == 0 && !snaps.empty()) {
+                auto copy = snaps[rng() % snaps.size()];
+                snaps.push_back(copy);
+            } else {
+                snaps.emplace_back(tr.snapshot(), a);
+            }
+        }
+        if (step % 53 == 0 && !check_snaps(step)) return false;
+
+        int sz = (int)a.size();
+        if (sz == 0) {
+            auto v = rng() % 1000;
+            tr.insert_at(1, v);
+            a.insert(a.begin(), v);
+            continue;
+        }
+        int op = rng() % 13;
+        if (bias == 1 && rng() % 2) op = 4;
+        if (bias == 2 && rng() % 2) op = 3;
+        int l = rng() % sz + 1, r = rng() % sz + 1;
+        if (l > r) swap(l, r);
+
+        if (op == 0) {
+            auto v = rng() % 1000;
+            tr.point_set(l, v);
+            a[l - 1] = v;
+        } else if (op == 1) {
+            auto want = fold<P>(a, l, r);
+            if (tr.range_query(l, r) != want) return mismatch("range_query", policy, threshold, step);
+            if (cfg.concurrent_reads && !cfg.concurrent_writes && tr.concurrent_query(l, r) != want)
+                return mismatch("concurrent_query", policy, threshold, step);
+        } else if (op == 2) {
+            auto d = rng() % 50;
+            if (rng() % 2 && hot_r <= sz) {
+                l = hot_l;
+                r = hot_r;
+            } else {
+                hot_l = l;
+                hot_r = r;
+            }
+            tr.range_apply(l, r, d);
+            add<P>(a, l, r, d);
+        } else if (op == 3) {
+            int p = rng() % (sz + 1) + 1;
+            auto v = rng() % 1000;
+            tr.insert_at(p, v);
+            a.insert(a.begin() + p - 1, v);
+        } else if (op == 4) {
+            tr.erase_at(l);
+            a.erase(a.begin() + l - 1);
+        } else if (op == 5) {
+            // Out-of-range ends are clamped; queries over nothing give AGG_ID.
+            // Batches of kParallelBatchMin (256) ops or more go to the pool
+            // when batch_threads > 1.
+            int m = rng() % 5 == 0 ? rng() % 600 + 1 : rng() % 40 + 1;
+            vector<B> ops;
+            Vec want;
+            for (int q = 0; q < m; ++q) {
+                int k = rng() % 3;
+                int L = rng() % (sz + 2), R = rng() % (sz + 2);
+                if (L > R) swap(L, R);
+                if (rng() % 3 == 0) L = 1, R = sz;
+                B b{(typename B::Kind)k, L, R, (typename P::Agg)(rng() % 1000), (typename P::Lazy)(rng() % 50)};
+                ops.push_back(b);
+                want.push_back(k == B::RangeQuery ? fold<P>(a, L, R) : P::AGG_ID);
+                if (k == B::RangeApply) add<P>(a, L, R, b.delta);
+                if (k == B::PointSet && L >= 1 && L <= sz) a[L - 1] = b.value;
+            }
+            if (tr.apply_batch(ops) != want) return mismatch("apply_batch", policy, threshold, step);
+        } else if (op == 6) {
+            int k = rng() % 4 == 0 ? rng() % 300 : rng() % 20;
+            Vec v(k);
+            for (auto& x : v) x = rng() % 1000;
+            int p = rng() % (sz + 3);
+            tr.insert_range(p, v);
+            p = max(1, min(p, sz + 1));
+            a.insert(a.begin() + p - 1, v.begin(), v.end());
+        } else if (op == 7) {
+            int L = rng() % (sz + 2), R = rng() % 4 ? L + rng() % 10 : rng() % (sz + 2);
+            tr.erase_range(L, R);
+            int lo = max(L, 1), hi = min(R, sz);
+            if (lo <= hi) a.erase(a.begin() + lo - 1, a.begin() + hi);
+        } else if (op == 8) {
+            int k = rng() % (sz + 3) - 1;
+            Tree rest = tr.split_at(k);
+            k = max(0, min(k, sz));
+            Vec ra(a.begin() + k, a.end());
+            a.resize(k);
+            if (tr.to_vector() != a || rest.to_vector() != ra) return mismatch("split_at", policy, threshold, step);
+            if (rng() % 3 == 0) snaps.emplace_back(rest.snapshot(), ra);
+            if (!ra.empty() && rng() % 2) {
+                int from = rng() % ra.size() + 1;
+                auto d = rng() % 50;
+                rest.range_apply(from, (int)ra.size(), d);
+                add<P>(ra, from, (int)ra.size(), d);
+            }
+            if (rng() % 2) {
+                tr.concat(std::move(rest));
+                a.insert(a.end(), ra.begin(), ra.end());
+            } else {
+                rest.concat(std::move(tr));
+                ra.insert(ra.end(), a.begin(), a.end());
+                a = ra;
+                tr = std::move(rest);
+            }
+        } else if (op == 9) {
+            int m = rng() % 4 == 0 ? rng() % 400 : rng() % 30;
+            Vec v(m);
+            for (auto& x : v) x = rng() % 1000;
+            Tree other(v, cfg);
+            if (rng() % 2 && m > 2) {
+                Tree tail = other.split_at(m / 2);
+                other.concat(std::move(tail));
+            }
+            if (rng() % 2) {
+                tr.concat(std::move(other));
+                a.insert(a.end(), v.begin(), v.end());
+            } else {
+                other.concat(std::move(tr));
+                v.insert(v.end(), a.begin(), a.end());
+                a = v;
+                tr = std::move(other);
+            }
+        } else if (op == 10) {
+            int L = rng() % (sz + 2), R = rng() % (sz + 2);
+            if (L > R) swap(L, R);
+            if (rng() % 3 == 0) {
+                L = rng() % sz + 1;
+                R = min(sz, L + (int)(rng() % 8));
+            }
+            tr.range_reverse(L, R);
+            int lo = max(L, 1), hi = min(R, sz);
+            if (lo < hi) reverse(a.begin() + lo - 1, a.begin() + hi);
+        } else if (op == 12) {
+            // Arena lifetimes: tr takes nodes of an arena that is still shared
+            // (other and its tail) and then dies with everything that used that
+            // arena, while z keeps tr's own arena and must not be handed memory
+            // from the dead one.
+            int k = rng() % (sz + 1);
+            Tree z = tr.split_at(k);
+            Vec za(a.begin() + k, a.end());
+            {
+                int m = rng() % 200 + 2;
+                Vec v(m);
+                for (auto& x : v) x = rng() % 1000;
+                Tree other(v, cfg);
+                Tree other_tail = other.split_at(m / 2);
+                tr.concat(std::move(other));
+                Tree dead = std::move(tr);
+            }
+            for (int q = rng() % 40; q >= 0; --q) {
+                int p = rng() % (za.size() + 1) + 1;
+                auto v = rng() % 1000;
+                z.insert_at(p, v);
+                za.insert(za.begin() + p - 1, v);
+            }
+            tr = std::move(z);
+            a = za;
+        } else {
+            // Positions out of range are clamped, and equal positions keep
+            // their order in the input (which need not be sorted).
+            int k = rng() % 4 == 0 ? rng() % (2 * min(sz, 150) + 5) : rng() % (min(sz, 800) / 8 + 3);
+            if (sz > 3000) k = rng() % 60;
+            vector<pair<int, typename P::Agg>> v(k);
+            for (auto& [p, x] : v) {
+                p = (int)(rng() % (sz + 4)) - 1;
+                x = rng() % 1000;
+            }
+            auto by_pos = [](auto& x, auto& y) { return x.first < y.first; };
+            if (rng() % 4) stable_sort(v.begin(), v.end(), by_pos);
+            tr.insert_many(v);
+            for (auto& [p, x] : v) p = max(1, min(p, sz + 1));
+            stable_sort(v.begin(), v.end(), by_pos);
+            Vec b;
+            size_t j = 0;
+            for (int i = 1; i <= sz + 1; ++i) {
+                while (j < v.size() && v[j].first <= i) b.push_back(v[j++].second);
+                if (i <= sz) b.push_back(a[i - 1]);
+            }
+            a = b;
+        }
+        if (step % 97 == 0 && (tr.size() != (int)a.size() || tr.to_vector() != a))
+            return mismatch("to_vector", policy, threshold, step);
+    }
+    return check_snaps(steps) && tr.to_vector() == a ? true : mismatch("final", policy, threshold, steps);
+}
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 50;
+    int steps = argc > 2 ? atoi(argv[2]) : 3000;
+    rng.seed(argc > 3 ? atoll(argv[3]) : 12345);
+
+    bool ok = true;
+    for (round_no = 0; round_no < rounds && ok; ++round_no) {
+        int threshold = round_no % 3 == 0 ? -1 : (int)(rng() % 6 + 2);
+        int maxn = round_no % 4 == 0 ? 2000 : 60;
+        ok = run<SumAddPolicy>("SumAdd", steps, threshold, maxn) &&
+             run<MinAddPolicy>("MinAdd", steps, threshold, maxn) &&
+             run<XorXorPolicy>("XorXor", steps, threshold, maxn) &&
+             run<OrOrPolicy>("OrOr", steps, threshold, maxn) &&
+             run<AndAndPolicy>("AndAnd", steps, threshold, maxn) &&
+             run<HashAddPolicy>("HashAdd", steps, threshold, maxn) &&
+             run<SumAddPolicy>("SumAdd", steps, 2, maxn) &&
+             run<MinAddPolicy>("MinAdd", steps, 3, maxn) &&
+             run<XorXorPolicy>("XorXor", steps, 5, maxn) &&
+             run<HashAddPolicy>("HashAdd", steps, 4, maxn) &&
+             run<SumAddPolicy>("SumAdd", steps, 8, maxn);
+    }
+    puts(ok ? "differential OK" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+// Stress test for ConcurrentBahnasyTree. Each thread owns a slice of the
+// sequence and posts range applies, point sets and queries inside it (query()
+// and futures from range_query(), sometimes more than a ring's worth of them
+// outstanding), and checks every answer against its own copy of the slice:
+// a thread's operations must run in the order it posted them. Thread 0 also
+// inserts and erases past the end, which shifts nothing the others own. Every
+// seed builds a new tree, so the threads' cached rings of the previous one
+// must not be reused; at the end the main thread checks each slice again.
+// A slice is worked by a chain of short-lived threads, one after the other
+// (each syncs before it exits), so rings are let go and taken over all the
+// time.
+//
+// Build & run (repo root); exits non-zero on a wrong answer:
+//   g++ -std=c++17 -O2 -pthread Benchmarks/stress/flat_combining.cpp -o flat_combining && ./flat_combining
+// Under sanitizers:
+//   g++ -std=c++17 -O1 -g -fsanitize=address -pthread Benchmarks/stress/flat_combining.cpp -o fc_asan
+//   g++ -std=c++17 -O1 -g -fsanitize=thread -pthread Benchmarks/stress/flat_combining.cpp -o fc_tsan
+// Arguments: [seeds = 3] [operations per slice = 100000] [slices = 4]
+//            [operations per thread = 2000]
+
+#define BAHNASY_NO_MAIN
+#include "../../src/Generic/bahnasy_generic_version.cpp"
+
+using namespace bahnasy;
+
+static bool run(unsigned seed, int ops, int threads, int per_thread) {
+    const int per = 300;
+    vector<long long> init(threads * per);
+    for (int i = 0; i < threads * per; ++i) init[i] = i % 7;
+    vector<vector<long long>> slices(threads);
+    atomic<long> bad{0};
+
+    ConcurrentBahnasyTree<SumAddPolicy> ct(init);
+    vector<thread> ts;
+    for (int t = 0; t < threads; ++t) {
+        ts.emplace_back([&, t] {
+            mt19937 rng(seed * 100 + t);
+            auto& a = slices[t];
+            a.assign(init.begin() + t * per, init.begin() + (t + 1) * per);
+            int base = t * per;
+            vector<pair<future<long long>, long long>> pending;
+            auto settle = [&] {
+                for (auto& [f, want] : pending)
+                    if (f.get() != want) ++bad;
+                pending.clear();
+            };
+            auto work = [&](int from, int to) {
+                for (int it = from; it < to; ++it) {
+                    int op = rng() % 6;
+                    int l = rng() % per, r = rng() % per;
+                    if (l > r) swap(l, r);
+                    if (rng() % 4 == 0) l = 0, r = 9; // a hot range: back-to-back applies compose
+                    if (op <= 1) {
+                        long long d = rng() % 10;
+                        ct.range_apply(base + l + 1, base + r + 1, d);
+                        for (int i = l; i <= r; ++i) a[i] += d;
+                    } else if (op == 2) {
+                        long long v = rng() % 100;
+                        ct.point_set(base + l + 1, v);
+                        a[l] = v;
+                    } else if (op == 3 && t == 0) {
+                        ct.insert_at(threads * per + 1, 5);
+                        ct.erase_at(threads * per + 1);
+                    } else {
+                        long long want = 0;
+                        for (int i = l; i <= r; ++i) want += a[i];
+                        if (rng() % 2) {
+                            if (ct.query(base + l + 1, base + r + 1) != want) ++bad;
+                        } else {
+                            pending.emplace_back(ct.range_query(base + l + 1, base + r + 1), want);
+                        }
+                    }
+                    if (pending.size() > 100 || rng() % 500 == 0) {
+                        settle();
+                        if (rng() % 2) ct.sync();
+                    }
+                }
+                settle();
+                ct.sync(); // the next thread's operations must come after these
+            };
+            for (int from = 0; from < ops; from += per_thread) {
+                thread worker(work, from, min(ops, from + per_thread));
+                worker.join();
+            }
+        });
+    }
+    for (auto& t : ts) t.join();
+
+    for (int t = 0; t < threads; ++t) {
+        for (int q = 0; q < 200; ++q) {
+            int l = q % per, r = min(per - 1, l + q);
+            long long want = 0;
+            for (int i = l; i <= r; ++i) want += slices[t][i];
+            if (ct.query(t * per + l + 1, t * per + r + 1) != want) ++bad;
+        }
+    }
+    printf("seed %u: %ld wrong answers\n", seed, bad.load());
+    return bad == 0;
+}
+
+int main(int argc, char** argv) {
+    int seeds = argc > 1 ? atoi(argv[1]) : 3;
+    int ops = argc > 2 ? atoi(argv[2]) : 100000;
+    int threads = argc > 3 ? atoi(argv[3]) : 4;
+    int per_thread = argc > 4 ? max(1, atoi(argv[4])) : 2000;
+    bool ok = true;
+    for (int s = 1; s <= seeds && ok; ++s) ok = run(s, ops, threads, per_thread);
+    puts(ok ? "flat_combining OK" : "FAIL");
+    return ok ? 0 : 1;
+}
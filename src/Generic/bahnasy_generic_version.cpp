@@ -1,4 +1,7 @@
 #include <bits/stdc++.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 using namespace std;
 
 /*
@@ -9,6 +12,7 @@ using namespace std;
     - range "lazy" update (add/xor/or/and/...) depending on the chosen Policy
     - point set
     - insert / erase
+    - range reverse (lazy, see "Range reversal" below)
     - occasional rebuilding to keep the structure balanced-ish
 
   Internally it is a multi-way tree:
@@ -18,10 +22,15 @@ using namespace std;
         lazy        = pending range update to be applied to its subtree
         children    = child subtrees
         prefixSizes = prefix sums of child sizes (for routing by index)
-    - Leaf level: nodes whose children are all size-1 leaves.
+    - Leaf level: "blocks" that keep their elements in a contiguous values
+      array (plus one block-wide lazy) instead of one node per element.
+    - Nodes live in a per-tree slab arena: no per-node new/delete, and
+      released nodes are recycled together with their vector capacity.
 
   Notes:
     - Indices are 1-based for public operations.
+    - (Re)builds pack the sequence bottom-up into an even tree of fanout <= T;
+      the SPF split rule is used for local splits of overgrown blocks.
 */
 
 namespace bahnasy {
@@ -46,6 +55,413 @@ private:
     vector<int> spf;
 };
 
+// ---------- Block kernels ----------
+// Blocks are dense arrays, so the common policies get vectorized reduce/apply
+// loops. A Policy opts in with `static constexpr BlockKernel BLOCK_KERNEL`
+// (Agg and Lazy must then be long long); anything else uses the scalar loop.
+// The AVX2 / AVX-512 variants are compiled with target attributes and picked
+// at runtime, so the default -O2 build still runs on any x86-64.
+
+enum class BlockKernel { Scalar, Sum, Min, Xor, Or, And };
+
+template <class P, class = void>
+struct block_kernel_of {
+    static constexpr BlockKernel value = BlockKernel::Scalar;
+};
+
+template <class P>
+struct block_kernel_of<P, void_t<decltype(P::BLOCK_KERNEL)>> {
+    static constexpr BlockKernel value = P::BLOCK_KERNEL;
+};
+
+namespace simd {
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BAHNASY_X86_SIMD 1
+#define BAHNASY_TARGET_AVX2 __attribute__((target("avx2")))
+#define BAHNASY_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+enum class Level { Scalar, Avx2, Avx512 };
+
+inline Level detect_level() {
+#ifdef BAHNASY_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return Level::Avx512;
+    if (__builtin_cpu_supports("avx2")) return Level::Avx2;
+#endif
+    return Level::Scalar;
+}
+
+inline Level level() {
+    static const Level lv = detect_level();
+    return lv;
+}
+
+// Each op is the combine of a reduction and the per-element lazy of one BlockKernel.
+struct AddOp {
+    static long long scalar(long long a, long long b) { return a + b; }
+#ifdef BAHNASY_X86_SIMD
+    BAHNASY_TARGET_AVX2 static __m256i v256(__m256i a, __m256i b) { return _mm256_add_epi64(a, b); }
+    BAHNASY_TARGET_AVX512 static __m512i v512(__m512i a, __m512i b) { return _mm512_add_epi64(a, b); }
+#endif
+};
+
+struct MinOp {
+    static long long scalar(long long a, long long b) { return std::min(a, b); }
+#ifdef BAHNASY_X86_SIMD
+    BAHNASY_TARGET_AVX2 static __m256i v256(__m256i a, __m256i b) {
+        return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+    }
+    BAHNASY_TARGET_AVX512 static __m512i v512(__m512i a, __m512i b) {
+        return _mm512_mask_blend_epi64(_mm512_cmpgt_epi64_mask(a, b), a, b);
+    }
+#endif
+};
+
+struct XorOp {
+    static long long scalar(long long a, long long b) { return a ^ b; }
+#ifdef BAHNASY_X86_SIMD
+    BAHNASY_TARGET_AVX2 static __m256i v256(__m256i a, __m256i b) { return _mm256_xor_si256(a, b); }
+    BAHNASY_TARGET_AVX512 static __m512i v512(__m512i a, __m512i b) { return _mm512_xor_si512(a, b); }
+#endif
+};
+
+struct OrOp {
+    static long long scalar(long long a, long long b) { return a | b; }
+#ifdef BAHNASY_X86_SIMD
+    BAHNASY_TARGET_AVX2 static __m256i v256(__m256i a, __m256i b) { return _mm256_or_si256(a, b); }
+    BAHNASY_TARGET_AVX512 static __m512i v512(__m512i a, __m512i b) { return _mm512_or_si512(a, b); }
+#endif
+};
+
+struct AndOp {
+    static long long scalar(long long a, long long b) { return a & b; }
+#ifdef BAHNASY_X86_SIMD
+    BAHNASY_TARGET_AVX2 static __m256i v256(__m256i a, __m256i b) { return _mm256_and_si256(a, b); }
+    BAHNASY_TARGET_AVX512 static __m512i v512(__m512i a, __m512i b) { return _mm512_and_si512(a, b); }
+#endif
+};
+
+template <class Op>
+long long reduce_scalar(const long long* a, int n, long long id) {
+    long long res = id;
+    for (int i = 0; i < n; ++i) res = Op::scalar(res, a[i]);
+    return res;
+}
+
+template <class Op>
+void apply_scalar(long long* a, int n, long long x) {
+    for (int i = 0; i < n; ++i) a[i] = Op::scalar(a[i], x);
+}
+
+#ifdef BAHNASY_X86_SIMD
+template <class Op>
+BAHNASY_TARGET_AVX2 long long reduce_avx2(const long long* a, int n, long long id) {
+    __m256i acc0 = _mm256_set1_epi64x(id), acc1 = acc0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = Op::v256(acc0, _mm256_loadu_si256((const __m256i*)(a + i)));
+        acc1 = Op::v256(acc1, _mm256_loadu_si256((const __m256i*)(a + i + 4)));
+    }
+    alignas(32) long long lanes[4];
+    _mm256_store_si256((__m256i*)lanes, Op::v256(acc0, acc1));
+    long long res = id;
+    for (long long v : lanes) res = Op::scalar(res, v);
+    for (; i < n; ++i) res = Op::scalar(res, a[i]);
+    return res;
+}
+
+template <class Op>
+BAHNASY_TARGET_AVX2 void apply_avx2(long long* a, int n, long long x) {
+    __m256i vx = _mm256_set1_epi64x(x);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i* p = (__m256i*)(a + i);
+        _mm256_storeu_si256(p, Op::v256(_mm256_loadu_si256(p), vx));
+    }
+    for (; i < n; ++i) a[i] = Op::scalar(a[i], x);
+}
+
+template <class Op>
+BAHNASY_TARGET_AVX512 long long reduce_avx512(const long long* a, int n, long long id) {
+    __m512i acc0 = _mm512_set1_epi64(id), acc1 = acc0;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = Op::v512(acc0, _mm512_loadu_si512(a + i));
+        acc1 = Op::v512(acc1, _mm512_loadu_si512(a + i + 8));
+    }
+    alignas(64) long long lanes[8];
+    _mm512_store_si512(lanes, Op::v512(acc0, acc1));
+    long long res = id;
+    for (long long v : lanes) res = Op::scalar(res, v);
+    for (; i < n; ++i) res = Op::scalar(res, a[i]);
+    return res;
+}
+
+template <class Op>
+BAHNASY_TARGET_AVX512 void apply_avx512(long long* a, int n, long long x) {
+    __m512i vx = _mm512_set1_epi64(x);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) _mm512_storeu_si512(a + i, Op::v512(_mm512_loadu_si512(a + i), vx));
+    for (; i < n; ++i) a[i] = Op::scalar(a[i], x);
+}
+#endif
+
+// id must be the identity of Op: every vector lane starts from it.
+template <class Op>
+long long reduce(const long long* a, int n, long long id) {
+#ifdef BAHNASY_X86_SIMD
+    // Short ranges are not worth the vector setup.
+    if (n >= 16) {
+        Level lv = level();
+        if (lv == Level::Avx512) return reduce_avx512<Op>(a, n, id);
+        if (lv == Level::Avx2) return reduce_avx2<Op>(a, n, id);
+    }
+#endif
+    return reduce_scalar<Op>(a, n, id);
+}
+
+template <class Op>
+void apply(long long* a, int n, long long x) {
+#ifdef BAHNASY_X86_SIMD
+    if (n >= 16) {
+        Level lv = level();
+        if (lv == Level::Avx512) return apply_avx512<Op>(a, n, x);
+        if (lv == Level::Avx2) return apply_avx2<Op>(a, n, x);
+    }
+#endif
+    apply_scalar<Op>(a, n, x);
+}
+
+// Reduction op and per-element lazy op for each kernel.
+template <BlockKernel K> struct kernel_ops;
+template <> struct kernel_ops<BlockKernel::Sum> { using Reduce = AddOp; using Apply = AddOp; };
+template <> struct kernel_ops<BlockKernel::Min> { using Reduce = MinOp; using Apply = AddOp; };
+template <> struct kernel_ops<BlockKernel::Xor> { using Reduce = XorOp; using Apply = XorOp; };
+template <> struct kernel_ops<BlockKernel::Or>  { using Reduce = OrOp;  using Apply = OrOp; };
+template <> struct kernel_ops<BlockKernel::And> { using Reduce = AndOp; using Apply = AndOp; };
+
+} // namespace simd
+
+// reduce(a, n)     = combine of a[0..n-1]
+// apply(a, n, upd) = a[i] = Policy::apply(a[i], upd, 1) for every i
+template <class Policy>
+struct BlockOps {
+    using Agg  = typename Policy::Agg;
+    using Lazy = typename Policy::Lazy;
+    static constexpr BlockKernel kernel = block_kernel_of<Policy>::value;
+
+    static Agg reduce(const Agg* a, int n) {
+        if constexpr (kernel == BlockKernel::Scalar) {
+            Agg res = Policy::AGG_ID;
+            for (int i = 0; i < n; ++i) res = Policy::combine(res, a[i]);
+            return res;
+        } else {
+            static_assert(is_same<Agg, long long>::value && is_same<Lazy, long long>::value,
+                          "BLOCK_KERNEL requires long long Agg and Lazy");
+            return simd::reduce<typename simd::kernel_ops<kernel>::Reduce>(a, n, Policy::AGG_ID);
+        }
+    }
+
+    static void apply(Agg* a, int n, Lazy upd) {
+        if constexpr (kernel == BlockKernel::Scalar) {
+            for (int i = 0; i < n; ++i) a[i] = Policy::apply(a[i], upd, 1);
+        } else {
+            simd::apply<typename simd::kernel_ops<kernel>::Apply>(a, n, upd);
+        }
+    }
+};
+
+// ---------- Child routing ----------
+// Routing an index i inside a node with n children means finding the first k
+// with prefix[k] >= i. Since prefix is non-decreasing that child is simply
+// #{k in [1, n-1] : prefix[k] < i}, which is a compare + popcount per vector
+// for narrow nodes and a branchless lower bound for wide ones.
+
+namespace routing {
+
+inline int count_less_scalar(const int* a, int n, int x) {
+    int cnt = 0;
+    for (int k = 0; k < n; ++k) cnt += (a[k] < x);
+    return cnt;
+}
+
+#ifdef BAHNASY_X86_SIMD
+BAHNASY_TARGET_AVX2 inline int count_less_avx2(const int* a, int n, int x) {
+    __m256i vx = _mm256_set1_epi32(x);
+    int cnt = 0, k = 0;
+    for (; k + 8 <= n; k += 8) {
+        __m256i gt = _mm256_cmpgt_epi32(vx, _mm256_loadu_si256((const __m256i*)(a + k)));
+        cnt += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(gt)));
+    }
+    return cnt + count_less_scalar(a + k, n - k, x);
+}
+
+BAHNASY_TARGET_AVX512 inline int count_less_avx512(const int* a, int n, int x) {
+    __m512i vx = _mm512_set1_epi32(x);
+    int cnt = 0, k = 0;
+    for (; k + 16 <= n; k += 16) {
+        cnt += __builtin_popcount(_mm512_cmplt_epi32_mask(_mm512_loadu_si512(a + k), vx));
+    }
+    if (k < n) {
+        __mmask16 tail = (__mmask16)((1u << (n - k)) - 1);
+        __m512i v = _mm512_maskz_loadu_epi32(tail, a + k);
+        cnt += __builtin_popcount(_mm512_mask_cmplt_epi32_mask(tail, v, vx));
+    }
+    return cnt;
+}
+#endif
+
+inline int count_less(const int* a, int n, int x) {
+#ifdef BAHNASY_X86_SIMD
+    simd::Level lv = simd::level();
+    if (lv == simd::Level::Avx512) return count_less_avx512(a, n, x);
+    if (lv == simd::Level::Avx2 && n >= 8) return count_less_avx2(a, n, x);
+#endif
+    return count_less_scalar(a, n, x);
+}
+
+// Index of the first a[k] >= x (n >= 1), without a data-dependent branch.
+inline int branchless_lower_bound(const int* a, int n, int x) {
+    const int* base = a;
+    while (n > 1) {
+        int half = n >> 1;
+        base = (base[half] < x) ? base + half : base;
+        n -= half;
+    }
+    return (int)(base - a) + (*base < x);
+}
+
+// Default for Config::linear_search_cutoff. 128 was tuned on AVX-512, where the
+// 16-lane count beats the branchless search up to about T = 256 (Benchmarks/
+// micro/routing_fanout.cpp); AVX2 and scalar hosts keep the earlier 32.
+inline int default_linear_cutoff() {
+    return simd::level() == simd::Level::Avx512 ? 128 : 32;
+}
+
+// prefix has n + 1 entries (prefix[0] = 0); returns the 0-based child holding i.
+inline int route(const int* prefix, int n, int i, int linear_cutoff) {
+    if (n <= 1) return 0;
+    if (n <= linear_cutoff) return count_less(prefix + 1, n - 1, i);
+    return branchless_lower_bound(prefix + 1, n - 1, i);
+}
+
+} // namespace routing
+
+// ---------- Bounded child arrays ----------
+// The subset of vector that Node uses for children and prefix sizes, over
+// storage the NodeArena binds from its table slabs. There are no capacity
+// checks: the tree keeps every node at most 4T + 2 children wide (see
+// Node::too_wide).
+template <class X>
+class BoundedArray {
+public:
+    BoundedArray() = default;
+    BoundedArray(const BoundedArray&) = delete;
+    BoundedArray& operator=(const BoundedArray& o) {
+        n_ = o.n_;
+        copy(o.begin(), o.end(), begin());
+        return *this;
+    }
+
+    // Storage handed out by the arena and given back to it.
+    void bind(X* storage, int cap) {
+        a_ = storage;
+        cap_ = cap;
+        n_ = 0;
+    }
+    X* unbind() {
+        n_ = cap_ = 0;
+        return std::exchange(a_, nullptr);
+    }
+    bool bound() const { return a_ != nullptr; }
+    int capacity() const { return cap_; }
+
+    int size() const { return n_; }
+    bool empty() const { return n_ == 0; }
+    X* data() { return a_; }
+    const X* data() const { return a_; }
+    X* begin() { return data(); }
+    X* end() { return data() + n_; }
+    const X* begin() const { return data(); }
+    const X* end() const { return data() + n_; }
+    X& operator[](int k) { return data()[k]; }
+    const X& operator[](int k) const { return data()[k]; }
+    X& back() { return data()[n_ - 1]; }
+
+    void clear() { n_ = 0; }
+    void resize(int n) {
+        if (n > n_) fill(end(), data() + n, X());
+        n_ = n;
+    }
+    void assign(int n, const X& x) {
+        fill(data(), data() + n, x);
+        n_ = n;
+    }
+    template <class It>
+    void assign(It first, It last) {
+        n_ = (int)(copy(first, last, data()) - data());
+    }
+    void assign(initializer_list<X> xs) { assign(xs.begin(), xs.end()); }
+
+    void push_back(const X& x) { data()[n_++] = x; }
+    X* insert(X* pos, const X& x) {
+        copy_backward(pos, end(), end() + 1);
+        *pos = x;
+        ++n_;
+        return pos;
+    }
+    template <class It>
+    X* insert(X* pos, It first, It last) {
+        int k = (int)distance(first, last);
+        copy_backward(pos, end(), end() + k);
+        copy(first, last, pos);
+        n_ += k;
+        return pos;
+    }
+    X* erase(X* pos) { return erase(pos, pos + 1); }
+    X* erase(X* first, X* last) {
+        copy(last, end(), first);
+        n_ -= (int)(last - first);
+        return first;
+    }
+
+private:
+    int n_ = 0;
+    X* a_ = nullptr;
+    int cap_ = 0;
+};
+
+// ---------- Range reversal ----------
+// A reversed range keeps its elements but not their order, so its aggregate is
+// unchanged only when combine is commutative. Such a Policy declares
+// `static constexpr bool REVERSAL_INVARIANT = true`; any other one provides
+// `static Agg reverse(Agg)` returning the aggregate of the mirrored range
+// (usually by keeping both directions inside Agg). range_reverse needs one of
+// them. Lazies must not depend on positions, so they commute with a reversal.
+
+template <class P, class = void>
+struct has_reverse : false_type {};
+
+template <class P>
+struct has_reverse<P, void_t<decltype(P::reverse(declval<typename P::Agg>()))>> : true_type {};
+
+template <class P, class = void>
+struct reversal_invariant : false_type {};
+
+template <class P>
+struct reversal_invariant<P, void_t<decltype(P::REVERSAL_INVARIANT)>> : bool_constant<P::REVERSAL_INVARIANT> {};
+
+template <class Policy>
+typename Policy::Agg reversed_aggregate(typename Policy::Agg a) {
+    if constexpr (has_reverse<Policy>::value) {
+        return Policy::reverse(a);
+    } else {
+        return a;
+    }
+}
+
 // ---------- Example Policies ----------
 
 struct SumAddPolicy {
@@ -54,6 +470,8 @@ struct SumAddPolicy {
 
     static constexpr Agg  AGG_ID  = 0;
     static constexpr Lazy LAZY_ID = 0;
+    static constexpr BlockKernel BLOCK_KERNEL = BlockKernel::Sum;
+    static constexpr bool REVERSAL_INVARIANT = true;
 
     static Agg  combine(Agg a, Agg b) { return a + b; }
     static Agg  apply(Agg agg, Lazy add, int len) { return agg + add * 1LL * len; }
@@ -66,6 +484,8 @@ struct MinAddPolicy {
 
     static constexpr Agg  AGG_ID  = (long long)4e18; // +INF
     static constexpr Lazy LAZY_ID = 0;               // +0
+    static constexpr BlockKernel BLOCK_KERNEL = BlockKernel::Min;
+    static constexpr bool REVERSAL_INVARIANT = true;
 
     static Agg  combine(Agg a, Agg b) { return std::min(a, b); }
     static Agg  apply(Agg agg, Lazy add, int /*len*/) { return agg + add; }
@@ -78,6 +498,8 @@ struct XorXorPolicy {
 
     static constexpr Agg  AGG_ID  = 0;
     static constexpr Lazy LAZY_ID = 0;
+    static constexpr BlockKernel BLOCK_KERNEL = BlockKernel::Xor;
+    static constexpr bool REVERSAL_INVARIANT = true;
 
     static Agg  combine(Agg a, Agg b) { return a ^ b; }
     // If you XOR every element by x, the segment XOR changes by x only when len is odd.
@@ -91,6 +513,8 @@ struct OrOrPolicy {
 
     static constexpr Agg  AGG_ID  = 0;
     static constexpr Lazy LAZY_ID = 0;
+    static constexpr BlockKernel BLOCK_KERNEL = BlockKernel::Or;
+    static constexpr bool REVERSAL_INVARIANT = true;
 
     static Agg  combine(Agg a, Agg b) { return a | b; }
     static Agg  apply(Agg agg, Lazy x, int /*len*/) { return agg | x; }
@@ -103,13 +527,240 @@ struct AndAndPolicy {
 
     static constexpr Agg  AGG_ID  = ~0LL; // all 1s
     static constexpr Lazy LAZY_ID = ~0LL; // neutral for "&"
+    static constexpr BlockKernel BLOCK_KERNEL = BlockKernel::And;
+    static constexpr bool REVERSAL_INVARIANT = true;
 
     static Agg  combine(Agg a, Agg b) { return a & b; }
     static Agg  apply(Agg agg, Lazy x, int /*len*/) { return agg & x; }
     static Lazy compose(Lazy cur, Lazy x) { return cur & x; }
 };
 
+// ---------- Work-stealing pool ----------
+// Fork-join pool behind parallel batches. Every thread owns a deque: it runs
+// its own tasks newest first and, once that runs dry, steals the oldest task of
+// another thread. A thread waiting on a join keeps running tasks meanwhile, so
+// forks nested in tasks cannot deadlock. The thread that built the pool is one
+// of its threads.
+
+class WorkStealingPool {
+public:
+    struct Join {
+        atomic<int> left{0};
+    };
+
+    explicit WorkStealingPool(int threads) : queues_(max(1, threads)) {
+        for (auto& q : queues_) q = make_unique<Queue>();
+        for (int i = 1; i < (int)queues_.size(); ++i) workers_.emplace_back([this, i] { work(i); });
+    }
+
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> lk(sleep_mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& w : workers_) w.join();
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    int threads() const { return (int)queues_.size(); }
+
+    void spawn(Join& join, function<void()> f) {
+        join.left.fetch_add(1, memory_order_relaxed);
+        Queue& q = *queues_[self()];
+        {
+            lock_guard<mutex> lk(q.m);
+            q.tasks.push_back({std::move(f), &join});
+        }
+        queued_.fetch_add(1);
+        if (sleeping_.load() > 0) {
+            lock_guard<mutex> lk(sleep_mutex_);
+            wake_.notify_one();
+        }
+    }
+
+    // Runs tasks (any, not only join's) until everything spawned on join is done.
+    void wait(Join& join) {
+        while (join.left.load(memory_order_acquire) > 0) {
+            if (!run_one()) this_thread::yield();
+        }
+    }
+
+private:
+    struct Task {
+        function<void()> f;
+        Join* join;
+    };
+
+    struct Queue {
+        mutex m;
+        deque<Task> tasks;
+    };
+
+    // This thread's deque: workers know theirs, any other thread uses the first.
+    int self() const {
+        return current_pool() == this ? current_index() : 0;
+    }
+
+    static const WorkStealingPool*& current_pool() {
+        static thread_local const WorkStealingPool* pool = nullptr;
+        return pool;
+    }
+
+    static int& current_index() {
+        static thread_local int index = 0;
+        return index;
+    }
+
+    bool run_one() {
+        int me = self(), k = (int)queues_.size();
+        Task t;
+        bool found = false;
+        for (int d = 0; d < k && !found; ++d) {
+            Queue& q = *queues_[(me + d) % k];
+            lock_guard<mutex> lk(q.m);
+            if (q.tasks.empty()) continue;
+            if (d == 0) {
+                t = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                t = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            found = true;
+        }
+        if (!found) return false;
+        queued_.fetch_sub(1);
+        t.f();
+        t.join->left.fetch_sub(1, memory_order_release);
+        return true;
+    }
+
+    // A spawn reads sleeping_ after bumping queued_ and a sleeper does the
+    // reverse, so one of them sees the other and no wakeup is lost.
+    void work(int index) {
+        current_pool() = this;
+        current_index() = index;
+        for (;;) {
+            if (run_one()) continue;
+            unique_lock<mutex> lk(sleep_mutex_);
+            sleeping_.fetch_add(1);
+            wake_.wait(lk, [&] { return stop_ || queued_.load() > 0; });
+            sleeping_.fetch_sub(1);
+            if (stop_) return;
+        }
+    }
+
+    vector<unique_ptr<Queue>> queues_; // [0]: the threads that are not workers
+    vector<thread> workers_;
+    atomic<int> queued_{0};
+    atomic<int> sleeping_{0};
+    mutex sleep_mutex_;
+    condition_variable wake_;
+    bool stop_ = false;
+};
+
+// ---------- Deferred frees for optimistic readers ----------
+// Block values live in vectors that inserts, erases and merges reallocate, and a
+// concurrent_query racing the writer may still be reading the old buffer. While
+// a write runs on a tree with concurrent_reads, it points retire_target() at
+// that tree's retire list, and buffers freed on the thread go there instead of
+// back to the heap. ReaderEpochs frees them once no reader can hold them.
+
+inline vector<void*>*& retire_target() {
+    static thread_local vector<void*>* target = nullptr;
+    return target;
+}
+
+template <class T>
+struct RetiringAllocator {
+    using value_type = T;
+
+    RetiringAllocator() = default;
+    template <class U>
+    RetiringAllocator(const RetiringAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T))); }
+
+    void deallocate(T* p, size_t) {
+        if (vector<void*>* t = retire_target()) t->push_back(p);
+        else ::operator delete(p);
+    }
+
+    template <class U>
+    bool operator==(const RetiringAllocator<U>&) const { return true; }
+    template <class U>
+    bool operator!=(const RetiringAllocator<U>&) const { return false; }
+};
+
+// Two reader counters indexed by epoch parity, as in sleepable RCU. A reader
+// counts itself under the epoch it saw (and re-checks it, so the writer cannot
+// have moved on unseen); buffers retired in epoch e are freed when the writer
+// leaves epoch e + 1, which it only does once no reader counted under e's
+// parity is left, and every reader that came later started after they were
+// unlinked.
+class ReaderEpochs {
+public:
+    class Reading {
+    public:
+        explicit Reading(ReaderEpochs& ep) : ep_(ep), e_(ep.enter()) {}
+        ~Reading() { ep_.readers_[e_ & 1].fetch_sub(1, memory_order_release); }
+        Reading(const Reading&) = delete;
+        Reading& operator=(const Reading&) = delete;
+
+    private:
+        ReaderEpochs& ep_;
+        unsigned e_;
+    };
+
+    ReaderEpochs() = default;
+    ReaderEpochs(const ReaderEpochs&) = delete;
+    ReaderEpochs& operator=(const ReaderEpochs&) = delete;
+
+    ~ReaderEpochs() {
+        for (auto& r : retired_) free_all(r);
+    }
+
+    // Writer side: where the current write sends the buffers it frees.
+    vector<void*>* retire_list() { return &retired_[epoch_.load(memory_order_relaxed) & 1]; }
+
+    // Writer side, after a write is published.
+    void reclaim() {
+        if (retired_[0].empty() && retired_[1].empty()) return;
+        unsigned e = epoch_.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (readers_[(e + 1) & 1].load(memory_order_acquire) != 0) return;
+        free_all(retired_[(e + 1) & 1]);
+        epoch_.store(e + 1);
+    }
+
+private:
+    unsigned enter() {
+        for (;;) {
+            unsigned e = epoch_.load();
+            readers_[e & 1].fetch_add(1);
+            if (epoch_.load() == e) return e;
+            readers_[e & 1].fetch_sub(1);
+        }
+    }
+
+    static void free_all(vector<void*>& bufs) {
+        for (void* p : bufs) ::operator delete(p);
+        bufs.clear();
+    }
+
+    atomic<unsigned> epoch_{0};
+    atomic<int> readers_[2] = {{0}, {0}};
+    vector<void*> retired_[2];
+};
+
 // ---------- The tree itself ----------
+// The fanout T is Config::leaf_threshold, by default derived from n at the
+// first build; set it to fix T. Children and prefix sizes sit together in one
+// table per internal node, carved from the arena, so blocks carry no child
+// arrays.
 
 template <class Policy>
 class BahnasyTree {
@@ -119,252 +770,1328 @@ public:
 
     struct Config {
         int max_spf = 200000;        // sieve upper bound for smallest-prime-factor
-        int linear_search_cutoff = 32; // for finding child by prefix sizes
-        int leaf_threshold = -1;      // if -1: auto derived from n
-        int rebuild_after_splits = -1; // if -1: auto derived from threshold
+        int linear_search_cutoff = -1; // up to this fanout route by SIMD count, above by binary search;
+                                       // if -1: 128 with AVX-512, else 32 (see routing::default_linear_cutoff)
+        int leaf_threshold = -1;      // fanout T; if -1: auto derived from n
+        int height_slack = 2;          // levels a subtree may exceed its balanced height by
+        int rebuild_after_erases = -1; // if -1: half of the size at the last (re)build
+        int arena_slab_nodes = 4096;   // nodes carved per arena slab
+        int max_rebuild_work_per_op = 0; // 0: rebuild at once; else work per operation (nodes, values).
+                                         // Bulk and reshaping calls (insert_range, insert_many,
+                                         // erase_range, range_reverse, split_at, concat) still
+                                         // rebuild the subtrees they overgrow at once
+        bool background_rebuild = false; // build the replacement tree on a worker thread
+        int merge_insert_ratio = 8;    // insert_many merges and rebuilds once k * ratio >= n
+        int apply_buffer_size = 8;     // range_apply calls held back for coalescing; 0: apply at once
+        bool concurrent_reads = false; // allow concurrent_query from other threads (turns the buffer off)
+        bool concurrent_writes = false; // point_set / range_apply from many threads at once (same)
+        int batch_threads = 1;         // apply_batch runs disjoint subtrees of large batches on this many threads
+                                       // (not with concurrent_reads)
+    };
+
+    struct BatchOp {
+        enum Kind { RangeQuery, RangeApply, PointSet } kind;
+        int l, r;    // 1-indexed; PointSet uses l
+        Agg value;   // PointSet
+        Lazy delta;  // RangeApply
     };
 
-    BahnasyTree() = default;
+    BahnasyTree() : BahnasyTree(vector<Agg>{}) {}
 
     explicit BahnasyTree(const vector<Agg>& initial, Config cfg = {})
         : cfg_(cfg),
-          spf_sieve_(make_unique<SmallestPrimeFactorSieve>(cfg_.max_spf)) {
+          spf_sieve_(make_shared<SmallestPrimeFactorSieve>(cfg_.max_spf)),
+          arena_(make_shared<NodeArena>(cfg_.arena_slab_nodes)) {
+        arena_->set_fanout(cfg_.leaf_threshold);
+        if (cfg_.linear_search_cutoff == -1) cfg_.linear_search_cutoff = routing::default_linear_cutoff();
+        if (cfg_.concurrent_writes) {
+            cfg_.apply_buffer_size = 0;
+            cfg_.concurrent_reads = false; // writers latch nodes through the versions readers check
+        }
+        if (cfg_.concurrent_reads) {
+            cfg_.apply_buffer_size = 0; // readers could not see buffered applies
+            arena_->track_writes(true);
+            epochs_ = make_unique<ReaderEpochs>();
+        }
+        WriteScope scope(*this, true);
         build_from_array(initial);
     }
 
+    BahnasyTree(BahnasyTree&& o) noexcept { *this = std::move(o); }
+
+    // When the arena may outlive this tree (split_at, concat and snapshots
+    // share it), the nodes go back to it; otherwise they go with its slabs.
+    ~BahnasyTree() {
+        release_nodes();
+        release_arenas();
+    }
+
+    BahnasyTree& operator=(BahnasyTree&& o) noexcept {
+        if (&o == this) return *this;
+        release_nodes();
+        release_arenas();
+        cfg_ = o.cfg_;
+        spf_sieve_ = std::move(o.spf_sieve_);
+        arena_ = std::move(o.arena_);
+        linked_arenas_ = std::move(o.linked_arenas_);
+        root_ = std::exchange(o.root_, nullptr);
+        erase_count_ = o.erase_count_;
+        erase_budget_ = o.erase_budget_;
+        pending_ = std::exchange(o.pending_, PendingRebuild{});
+        retired_ = std::move(o.retired_);
+        apply_buffer_ = std::move(o.apply_buffer_);
+        o.apply_buffer_.clear();
+        batch_pool_ = std::move(o.batch_pool_);
+        published_root_.store(o.published_root_.exchange(nullptr));
+        tree_version_.store(o.tree_version_.load());
+        epochs_ = std::move(o.epochs_);
+        return *this;
+    }
+
     int size() const { return root_ ? root_->subtree_size : 0; }
 
-    // 1-indexed
+    // 1-indexed. On a tree the caller may write to, a read that overlaps
+    // buffered applies flushes them, and pending rebuild work takes a step.
     Agg range_query(int l, int r) {
+        auto guard = exclusive();
+        WriteScope scope(*this, false);
+        flush_applies_over(l, r);
+        Agg res = root_ ? root_->read(l, r, cfg_.linear_search_cutoff) : Policy::AGG_ID;
+        step_rebuild();
+        return res;
+    }
+
+    // 1-indexed. Stores nothing, so any number of threads may read a tree that
+    // nobody writes: buffered applies are folded into the result instead. With
+    // concurrent_writes it holds the tree against latched writes, so readers go
+    // one at a time, and reads through the aggregates those writes left stale.
+    Agg range_query(int l, int r) const {
+        auto guard = hold();
         if (!root_) return Policy::AGG_ID;
-        return root_->range_query(l, r, cfg_.linear_search_cutoff);
+        l = max(l, 1);
+        r = min(r, size());
+        if (l > r) return Policy::AGG_ID;
+        if (!buffered_over(l, r)) return root_->read(l, r, cfg_.linear_search_cutoff);
+
+        // Cut [l, r] where buffered ranges start or end; each piece is then wholly
+        // inside or outside every entry, and takes the entries' deltas in order.
+        vector<int> cuts = {l, r + 1};
+        for (const BufferedApply& e : apply_buffer_) {
+            if (e.l > l && e.l <= r) cuts.push_back(e.l);
+            if (e.r >= l && e.r < r) cuts.push_back(e.r + 1);
+        }
+        sort(cuts.begin(), cuts.end());
+        cuts.erase(unique(cuts.begin(), cuts.end()), cuts.end());
+        Agg res = Policy::AGG_ID;
+        for (int i = 0; i + 1 < (int)cuts.size(); ++i) {
+            int a = cuts[i], b = cuts[i + 1] - 1;
+            Agg part = root_->read(a, b, cfg_.linear_search_cutoff);
+            for (const BufferedApply& e : apply_buffer_) {
+                if (e.l <= a && b <= e.r) part = Policy::apply(part, e.delta, b - a + 1);
+            }
+            res = Policy::combine(res, part);
+        }
+        return res;
     }
 
     // 1-indexed
     void range_apply(int l, int r, Lazy delta) {
+        if (cfg_.concurrent_writes && apply_shared(l, r, delta)) return;
+        auto guard = exclusive();
+        WriteScope scope(*this, false);
         if (!root_) return;
-        root_->range_apply(l, r, delta, cfg_.linear_search_cutoff);
+        l = max(l, 1);
+        r = min(r, size());
+        if (l > r) return;
+        if (cfg_.apply_buffer_size > 0) {
+            buffer_apply(l, r, delta);
+        } else {
+            apply_now(l, r, delta);
+        }
+        step_rebuild();
     }
 
     // 1-indexed
     void point_set(int idx, Agg value) {
+        if (cfg_.concurrent_writes && point_set_shared(idx, value)) return;
+        auto guard = exclusive();
+        WriteScope scope(*this, false);
         if (!root_) return;
-        root_->point_set(idx, value, cfg_.linear_search_cutoff);
+        flush_applies_over(idx, idx);
+        if (pending_.active) log_mutation({LoggedOp::PointSet, idx, idx, value, Policy::LAZY_ID});
+        writable_root()->point_set(idx, value, cfg_.linear_search_cutoff, *arena_);
+        step_rebuild();
     }
 
     // 1-indexed insertion position
     void insert_at(int idx, Agg value) {
+        auto guard = exclusive();
+        WriteScope scope(*this, false);
+        flush_applies();
         if (!root_) {
             build_from_array(vector<Agg>{value});
             return;
         }
-        bool did_split = root_->insert_at(
-                idx, value,
+        if (pending_.active) log_mutation({LoggedOp::Insert, idx, idx, value, Policy::LAZY_ID});
+        if (insert_into(root_, idx, value) && !pending_.active) start_rebuild();
+        step_rebuild();
+    }
+
+    // 1-indexed
+    void erase_at(int idx) {
+        auto guard = exclusive();
+        WriteScope scope(*this, false);
+        flush_applies();
+        if (!root_) return;
+        if (pending_.active) log_mutation({LoggedOp::Erase, idx, idx, Policy::AGG_ID, Policy::LAZY_ID});
+        erase_from(root_, idx);
+        if (!pending_.active && root_ && ++erase_count_ >= erase_budget_) start_rebuild();
+        step_rebuild();
+    }
+
+    // Same effect as issuing ops one by one, but with a single descent per
+    // touched node. Returns each RangeQuery result at its op's index (AGG_ID for
+    // the other kinds).
+    vector<Agg> apply_batch(const vector<BatchOp>& ops) {
+        auto guard = exclusive();
+        WriteScope scope(*this, true);
+        flush_applies();
+        vector<Agg> results(ops.size(), Policy::AGG_ID);
+        if (!root_) return results;
+        int n = size();
+        vector<typename Node::BatchItem> items;
+        items.reserve(ops.size());
+        for (int i = 0; i < (int)ops.size(); ++i) {
+            const BatchOp& op = ops[i];
+            int l = max(op.l, 1), r = min(op.kind == BatchOp::PointSet ? op.l : op.r, n);
+            if (l > r || (op.kind == BatchOp::PointSet && l != op.l)) continue;
+            if (pending_.active && op.kind == BatchOp::RangeApply)
+                log_mutation({LoggedOp::RangeApply, op.l, op.r, Policy::AGG_ID, op.delta});
+            if (pending_.active && op.kind == BatchOp::PointSet)
+                log_mutation({LoggedOp::PointSet, op.l, op.l, op.value, Policy::LAZY_ID});
+            items.push_back({i, l, r});
+        }
+        // Pool threads would free block buffers outside the readers' retire list.
+        if (cfg_.batch_threads > 1 && !cfg_.concurrent_reads && (int)items.size() >= kParallelBatchMin &&
+            !root_->is_block) {
+            if (!batch_pool_) batch_pool_ = make_unique<WorkStealingPool>(cfg_.batch_threads);
+            arena_->share(true);
+            writable_root()->run_batch(items.data(), (int)items.size(), ops.data(), results.data(),
+                                       cfg_.linear_search_cutoff, *arena_, batch_pool_.get(), fork_depth());
+            arena_->share(false);
+        } else {
+            writable_root()->run_batch(items.data(), (int)items.size(), ops.data(), results.data(),
+                                       cfg_.linear_search_cutoff, *arena_);
+        }
+        for (size_t i = 0; i < ops.size() && (pending_.active || !retired_.empty()); ++i) step_rebuild();
+        return results;
+    }
+
+    // 1-indexed, inclusive
+    void range_reverse(int l, int r) {
+        static_assert(reversal_invariant<Policy>::value || has_reverse<Policy>::value,
+                      "range_reverse needs REVERSAL_INVARIANT or reverse(Agg) in the Policy");
+        auto guard = exclusive();
+        WriteScope scope(*this, true);
+        flush_applies();
+        if (!root_) return;
+        if (pending_.active) log_mutation({LoggedOp::Reverse, l, r, Policy::AGG_ID, Policy::LAZY_ID});
+        reverse_in(root_, l, r);
+        step_rebuild();
+    }
+
+    // 1-indexed: values[0] ends up at position idx
+    void insert_range(int idx, const vector<Agg>& values) {
+        auto guard = exclusive();
+        WriteScope scope(*this, true);
+        flush_applies();
+        if (values.empty()) return;
+        if (!root_) {
+            build_from_array(values);
+            return;
+        }
+        // A bulk splice would flood the mutation log; an in-flight rebuild is dropped
+        // and the triggers below start a fresh one if the shape calls for it.
+        if (pending_.active) abort_rebuild();
+        writable_root()->insert_range(
+                idx, values.data(), (int)values.size(),
                 cfg_.linear_search_cutoff,
                 cfg_.leaf_threshold,
                 *spf_sieve_,
-                cfg_.max_spf
+                cfg_.max_spf,
+                cfg_.height_slack,
+                *arena_
         );
-        if (did_split && ++split_count_ >= cfg_.rebuild_after_splits) rebuild();
+        if (root_->height > Node::height_budget(root_->subtree_size, cfg_.leaf_threshold, cfg_.height_slack))
+            start_rebuild();
+        step_rebuild();
     }
 
-    // 1-indexed
-    void erase_at(int idx) {
+    // Inserts every (position, value) pair; positions refer to the sequence as it
+    // was before the call: a value lands before the element now at its position
+    // (size() + 1 appends) and values for the same position keep their order.
+    // Pairs should come sorted by position. A batch that is small against the
+    // tree is spliced in with one descent; a large one is merged with the
+    // existing elements into a freshly built tree in O(n + k).
+    void insert_many(const vector<pair<int, Agg>>& items) {
+        auto guard = exclusive();
+        WriteScope scope(*this, true);
+        flush_applies();
+        if (items.empty()) return;
+        int n = size();
+        vector<pair<int, Agg>> batch(items);
+        for (auto& it : batch) it.first = max(1, min(it.first, n + 1));
+        auto by_position = [](const pair<int, Agg>& a, const pair<int, Agg>& b) { return a.first < b.first; };
+        if (!is_sorted(batch.begin(), batch.end(), by_position)) stable_sort(batch.begin(), batch.end(), by_position);
+        if (!root_) {
+            vector<Agg> values;
+            values.reserve(batch.size());
+            for (auto& it : batch) values.push_back(it.second);
+            build_from_array(values);
+            return;
+        }
+        // Like insert_range, a batch would flood the mutation log.
+        if (pending_.active) abort_rebuild();
+        int k = (int)batch.size();
+        if ((long long)k * max(1, cfg_.merge_insert_ratio) >= n) {
+            merge_rebuild(batch);
+        } else {
+            root_ = Node::insert_many(writable_root(), batch.data(), k, 0,
+                                      cfg_.linear_search_cutoff, cfg_.leaf_threshold, cfg_.height_slack, *arena_);
+            if (root_->height > Node::height_budget(root_->subtree_size, cfg_.leaf_threshold, cfg_.height_slack))
+                start_rebuild();
+        }
+        step_rebuild();
+    }
+
+    // 1-indexed, inclusive
+    void erase_range(int l, int r) {
+        auto guard = exclusive();
+        WriteScope scope(*this, true);
+        flush_applies();
         if (!root_) return;
-        root_->erase_at(idx, cfg_.linear_search_cutoff);
-        if (root_->subtree_size == 0) root_.reset();
+        if (pending_.active) abort_rebuild();
+        writable_root()->erase_range(l, r, cfg_.linear_search_cutoff, cfg_.leaf_threshold, *arena_);
+        if (root_->subtree_size == 0) {
+            Node::release_subtree(root_, *arena_);
+            root_ = nullptr;
+            return;
+        }
+        collapse_root(root_);
+        // Only the two boundary paths change shape, so this counts as one erase.
+        if (++erase_count_ >= erase_budget_) start_rebuild();
+        step_rebuild();
+    }
+
+    // Cuts after position k: this tree keeps [1, k] and the returned tree holds
+    // the rest; only the cut path is touched.
+    // The returned tree allocates from an arena of its own, so after the call
+    // each tree may be written from its own thread. The nodes it starts with
+    // stay in this tree's arena, which it keeps alive and which from then on
+    // locks every allocation and release for as long as both trees live. A
+    // snapshot taken before the cut holds nodes of both trees: copy or drop it
+    // only while neither is written.
+    BahnasyTree split_at(int k) {
+        auto guard = exclusive();
+        WriteScope scope(*this, true);
+        flush_applies();
+        if (pending_.active) abort_rebuild();
+        // T may still be unset on an empty tree; each tree then derives its own
+        // on first build.
+        BahnasyTree rest(cfg_, spf_sieve_, make_shared<NodeArena>(cfg_.arena_slab_nodes));
+        rest.arena_->set_fanout(cfg_.leaf_threshold);
+        if (!root_) return rest;
+        rest.link_arena(arena_);
+        for (auto& a : linked_arenas_) rest.link_arena(a);
+        k = max(0, min(k, size()));
+        auto cut = Node::split(writable_root(), k, cfg_.linear_search_cutoff, cfg_.leaf_threshold, *arena_);
+        root_ = cut.first;
+        rest.root_ = cut.second;
+        after_reshape();
+        rest.after_reshape();
+        if (cfg_.concurrent_reads) rest.published_root_.store(rest.root_, memory_order_release);
+        return rest;
+    }
+
+    // Appends other's sequence and leaves other empty. The shorter tree is hung
+    // on the facing spine of the taller one, so only that spine is touched.
+    void concat(BahnasyTree&& other) {
+        if (&other == this || !other.root_) return;
+        // Both trees' locks go in address order, so concats running the other
+        // way round between the same trees cannot deadlock.
+        bool this_first = this < &other;
+        auto first_guard = this_first ? exclusive() : other.exclusive();
+        auto second_guard = this_first ? other.exclusive() : exclusive();
+        WriteScope scope(*this, true);
+        WriteScope other_scope(other, true);
+        flush_applies();
+        other.flush_applies();
+        if (pending_.active) abort_rebuild();
+        if (other.pending_.active) other.abort_rebuild();
+        other.drain_retired(INT_MAX);
+        // other's nodes now belong to this tree: take its slabs outright when
+        // nobody else uses them, otherwise keep its arena alive alongside ours.
+        if (other.arena_ != arena_ && other.arena_.use_count() == 1)
+            arena_->adopt(*other.arena_);
+        else
+            link_arena(other.arena_);
+        for (auto& a : other.linked_arenas_) link_arena(a);
+        Node* b = std::exchange(other.root_, nullptr);
+        other.published_root_.store(nullptr, memory_order_release);
+        if (cfg_.leaf_threshold == -1) {
+            cfg_.leaf_threshold = other.cfg_.leaf_threshold;
+            arena_->set_fanout(cfg_.leaf_threshold);
+        }
+        // Node widths (and table capacities) follow T, so a tree built with
+        // another T is rebuilt from its values; its nodes may still be shared
+        // with snapshots, which must keep their own widths.
+        if (b && max(2, other.cfg_.leaf_threshold) != max(2, cfg_.leaf_threshold)) {
+            vector<Agg> vals;
+            vals.reserve(b->subtree_size);
+            b->collect(1, b->subtree_size, cfg_.linear_search_cutoff, vals);
+            Node::release_subtree(b, *arena_);
+            b = Node::build_balanced(vals.data(), (int)vals.size(), cfg_.leaf_threshold, *arena_);
+        } else {
+            b = Node::own(b, *arena_);
+        }
+        root_ = root_ ? Node::join(writable_root(), b, cfg_.leaf_threshold, *arena_) : b;
+        after_reshape();
+    }
+
+    // 1-indexed. With Config::concurrent_reads, any number of threads may call
+    // this while one thread writes. Readers take no lock: each node carries a
+    // version that writers hold odd while they change it, and a reader checks
+    // the versions on its path (every node against its parent, the way down)
+    // and starts over from the root when one moved. point_set, range_apply,
+    // insert_at and erase_at hold the nodes on their paths, so a read that is
+    // past the root when one starts only retries if it crosses them; other
+    // writes hold the whole tree. Block buffers a write frees are kept until the
+    // readers that could see them are done; a Snapshot frees its own directly,
+    // so drop snapshots while no reader runs.
+    // Without concurrent_reads this is the const range_query.
+    Agg concurrent_query(int l, int r) const {
+        if (!cfg_.concurrent_reads) return range_query(l, r);
+        ReaderEpochs::Reading reading(*epochs_);
+        for (;; this_thread::yield()) {
+            OptimisticRead rd{cfg_.linear_search_cutoff, &tree_version_, tree_version_.load(memory_order_acquire)};
+            if (rd.seen & 1) continue;
+            const Node* root = published_root_.load(memory_order_acquire);
+            Agg res = Policy::AGG_ID;
+            if (root) {
+                unsigned v = root->version.load(memory_order_acquire);
+                if ((v & 1) || !root->read_optimistic(l, r, rd, v, nullptr, 0, res)) continue;
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (tree_version_.load(memory_order_relaxed) == rd.seen &&
+                published_root_.load(memory_order_relaxed) == root)
+                return res;
+        }
     }
 
-    vector<Agg> to_vector() {
+    vector<Agg> to_vector() const {
+        auto guard = hold();
         vector<Agg> out;
         if (!root_) return out;
         out.reserve(root_->subtree_size);
-        root_->collect_values(out);
+        root_->collect(1, root_->subtree_size, cfg_.linear_search_cutoff, out);
+        for (const BufferedApply& e : apply_buffer_) {
+            for (int i = e.l - 1; i < e.r; ++i) out[i] = Policy::apply(out[i], e.delta, 1);
+        }
         return out;
     }
 
 private:
-    struct Node {
-        int subtree_size = 0;
-        Agg aggregate = Policy::AGG_ID;
-        Lazy lazy = Policy::LAZY_ID;
-
-        vector<unique_ptr<Node>> children;
+    struct Node;
+    using Values = vector<Agg, RetiringAllocator<Agg>>; // a block's values (see retire_target)
+
+    // Widest a node gets: too_wide allows 4T children, and a reversal or a join
+    // adds up to two more before the parent notices.
+    static constexpr int child_cap(int t) { return 4 * max(2, t) + 2; }
+
+    // Slab allocator for nodes. Slabs are never returned until the last tree or
+    // snapshot holding nodes of the arena dies; released nodes keep their
+    // vectors' capacity so reuse rarely touches malloc.
+    // A node remembers the arena it was carved from (Node::home) and goes back
+    // to that arena's free list, with its table, whichever tree lets it go: a
+    // tree holding nodes of another arena (after concat) keeps that arena alive
+    // but never hands its memory out.
+    // Internal nodes also get a table from here: child_cap(T) child slots
+    // followed by child_cap(T) + 1 prefix slots in one chunk, so the arrays a
+    // routing step reads are adjacent and never reallocate.
+    class NodeArena {
+    public:
+        explicit NodeArena(int slab_nodes) : slab_nodes_(max(1, slab_nodes)) {}
+
+        void set_fanout(int t) {
+            if (child_cap(t) == tables_[0].cap) return;
+            tables_[0] = TablePool{child_cap(t), {}};
+        }
 
-        vector<int> prefix_sizes; // prefix_sizes[k] = sum(children[0..k-1].subtree_size)
-        bool prefix_dirty = true;
+        // Gives an internal node (or a block turning into one) its arrays. The
+        // one-child nodes that tag_child puts over shared subtrees are never
+        // widened (writers fold them first), so they take a one-slot table.
+        void attach_table(Node* p, bool one_child = false) {
+            if (p->children.bound()) return;
+            p->home->bind_table(p, one_child);
+        }
 
-        explicit Node(int n = 0) : subtree_size(n) {}
+        // concurrent_reads: a write locks (makes odd) the version of every node it
+        // changes, reuses or frees, except a child it only tags (its parent is
+        // held), and unlock_all() publishes them when the write ends.
+        void track_writes(bool on) { track_writes_ = on; }
 
-        bool is_leaf_level_parent() const {
-            return !children.empty() && children[0]->children.empty();
+        void lock(Node* p) {
+            if (track_writes_) hold(p);
         }
 
-        void mark_prefix_dirty() { prefix_dirty = true; }
+        void unlock_all() {
+            for (Node* p : locked_) p->version.store(p->version.load(memory_order_relaxed) + 1, memory_order_release);
+            locked_.clear();
+        }
 
-        void rebuild_prefix_sizes() {
-            if (!prefix_dirty) return;
-            prefix_sizes.assign(children.size() + 1, 0);
-            for (int i = 0; i < (int)children.size(); ++i) {
-                prefix_sizes[i + 1] = prefix_sizes[i] + children[i]->subtree_size;
+        // concurrent_writes: latched writers copying nodes off a snapshot allocate
+        // under this.
+        recursive_mutex& alloc_mutex() { return alloc_mutex_; }
+
+        // Parallel batches: while on, the arena serves several threads and takes
+        // alloc_mutex_ itself.
+        void share(bool on) { shared_ = on; }
+
+        // Trees other than the owner (split_at, concat) and snapshots taken
+        // meanwhile may free nodes of this arena from their own threads: while
+        // more than one of them holds it, every allocation and release takes
+        // alloc_mutex_. The last one to let go before another writes it hands
+        // its releases over through holders_.
+        void add_holder() { holders_.fetch_add(1, memory_order_relaxed); }
+        void drop_holder() { holders_.fetch_sub(1, memory_order_release); }
+        bool between_trees() const { return holders_.load(memory_order_acquire) > 1; }
+
+        Node* make(int n) {
+            Node* p;
+            {
+                auto guard = exclusive();
+                if (!free_list_.empty()) {
+                    p = free_list_.back();
+                    free_list_.pop_back();
+                } else {
+                    if (next_in_slab_ == slab_nodes_) {
+                        ++cur_slab_;
+                        next_in_slab_ = 0;
+                    }
+                    if (cur_slab_ == (int)slabs_.size()) slabs_.push_back(make_unique<Node[]>(slab_nodes_));
+                    p = &slabs_[cur_slab_][next_in_slab_++];
+                    p->home = this;
+                }
             }
-            prefix_dirty = false;
+            lock(p);
+            p->reset(n);
+            return p;
         }
 
-        void pull() {
-            Agg res = Policy::AGG_ID;
-            for (auto& c : children) res = Policy::combine(res, c->aggregate);
-            aggregate = res;
+        void release(Node* p) {
+            lock(p);
+            p->home->take_back(p);
         }
 
-        void apply_to_this_node(Lazy upd) {
-            aggregate = Policy::apply(aggregate, upd, subtree_size);
-            lazy = Policy::compose(lazy, upd);
+        // Takes ownership of every node of other (e.g. a tree built on another
+        // thread); the untouched tail of its current slab becomes free nodes here.
+        // Re-homing its nodes is one pass over its slabs.
+        void adopt(NodeArena& other) {
+            auto guard = exclusive();
+            for (auto& slab : other.slabs_) {
+                for (int i = 0; i < other.slab_nodes_; ++i) slab[i].home = this;
+            }
+            if (other.cur_slab_ < (int)other.slabs_.size()) {
+                Node* tail = other.slabs_[other.cur_slab_].get();
+                for (int i = other.next_in_slab_; i < other.slab_nodes_; ++i) free_list_.push_back(&tail[i]);
+            }
+            int k = (int)other.slabs_.size();
+            slabs_.insert(slabs_.begin() + cur_slab_,
+                          make_move_iterator(other.slabs_.begin()), make_move_iterator(other.slabs_.end()));
+            cur_slab_ += k;
+            free_list_.insert(free_list_.end(), other.free_list_.begin(), other.free_list_.end());
+            other.slabs_.clear();
+            other.free_list_.clear();
+            other.cur_slab_ = other.next_in_slab_ = 0;
+
+            table_slabs_.insert(table_slabs_.end(), make_move_iterator(other.table_slabs_.begin()),
+                                make_move_iterator(other.table_slabs_.end()));
+            for (int i = 0; i < 2; ++i) {
+                auto& from = other.tables_[i].free;
+                if (other.tables_[i].cap == tables_[i].cap)
+                    tables_[i].free.insert(tables_[i].free.end(), from.begin(), from.end());
+                other.tables_[i].free.clear();
+            }
+            other.table_slabs_.clear();
+            other.table_room_ = 0;
         }
 
-        void push() {
-            if (children.empty()) return;
-            if (lazy == Policy::LAZY_ID) return;
-            for (auto& c : children) c->apply_to_this_node(lazy);
-            lazy = Policy::LAZY_ID;
+    private:
+        void bind_table(Node* p, bool one_child) {
+            auto guard = exclusive();
+            TablePool& pool = tables_[one_child ? 1 : 0];
+            char* t;
+            if (!pool.free.empty()) {
+                t = pool.free.back();
+                pool.free.pop_back();
+            } else {
+                t = carve(pool.bytes());
+            }
+            p->children.bind((Node**)t, pool.cap);
+            p->prefix_sizes.bind((int*)(t + pool.cap * sizeof(Node*)), pool.cap + 1);
         }
 
-        int choose_child_by_index(int i_1_based, int linear_cutoff) {
-            rebuild_prefix_sizes();
-            int n = (int)children.size();
-            if (n <= 1) return 0;
-
-            if (n <= linear_cutoff) {
-                for (int k = 1; k <= n; ++k)
-                    if (prefix_sizes[k] >= i_1_based) return k - 1;
-                return n - 1;
+        void take_back(Node* p) {
+            auto guard = exclusive();
+            if (p->children.bound()) {
+                // Tables of another fanout (a concat partner's) are not reused.
+                int cap = p->children.capacity();
+                char* t = (char*)p->children.unbind();
+                p->prefix_sizes.unbind();
+                for (auto& pool : tables_) {
+                    if (pool.cap == cap) {
+                        pool.free.push_back(t);
+                        break;
+                    }
+                }
             }
+            free_list_.push_back(p);
+        }
 
-            int l = 0, r = n;
-            while (l + 1 < r) {
-                int m = (l + r) >> 1;
-                if (prefix_sizes[m] < i_1_based) l = m;
-                else r = m;
+        int slab_nodes_;
+        int cur_slab_ = 0;
+        int next_in_slab_ = 0;
+        vector<unique_ptr<Node[]>> slabs_;
+        vector<Node*> free_list_;
+
+        struct TablePool {
+            int cap = 0;
+            vector<char*> free;
+            int bytes() const { return (int)((cap * sizeof(Node*) + (cap + 1) * sizeof(int) + 15) / 16 * 16); }
+        };
+
+        char* carve(int bytes) {
+            if (table_room_ < bytes) {
+                table_room_ = max(bytes, 64 << 10);
+                table_slabs_.push_back(make_unique<char[]>(table_room_ + 64));
+                next_table_ = (char*)(((uintptr_t)table_slabs_.back().get() + 63) & ~(uintptr_t)63);
             }
-            return l;
+            char* t = next_table_;
+            next_table_ += bytes;
+            table_room_ -= bytes;
+            return t;
         }
 
-        Agg range_query(int l, int r, int linear_cutoff) {
-            if (children.empty() || l > subtree_size || r < 1) return Policy::AGG_ID;
-            l = max(l, 1);
-            r = min(r, subtree_size);
-            if (l > r) return Policy::AGG_ID;
-            if (l == 1 && r == subtree_size) return aggregate;
+        TablePool tables_[2] = {TablePool{0, {}}, TablePool{1, {}}}; // full width, one child
+        int table_room_ = 0;
+        char* next_table_ = nullptr;
+        vector<unique_ptr<char[]>> table_slabs_;
 
-            push();
+        bool track_writes_ = false;
+        vector<Node*> locked_;
+        recursive_mutex alloc_mutex_;
+        bool shared_ = false;
+        atomic<int> holders_{1}; // the owning tree
 
-            if (is_leaf_level_parent()) {
-                Agg res = Policy::AGG_ID;
-                for (int i = l; i <= r; ++i) res = Policy::combine(res, children[i - 1]->aggregate);
-                return res;
+        unique_lock<recursive_mutex> exclusive() {
+            return shared_ || between_trees() ? unique_lock<recursive_mutex>(alloc_mutex_)
+                                              : unique_lock<recursive_mutex>();
+        }
+
+        // Out of line: lock() sits on every write path and must stay a test.
+        __attribute__((noinline)) void hold(Node* p) {
+            unsigned v = p->version.load(memory_order_relaxed);
+            if (v & 1) return;
+            p->version.store(v + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            auto guard = exclusive();
+            locked_.push_back(p);
+        }
+    };
+
+    // What a concurrent_query carries down the tree.
+    struct OptimisticRead {
+        int linear_cutoff;
+        const atomic<unsigned>* tree_version;
+        unsigned seen; // tree_version when the read started (even)
+    };
+
+    struct Node {
+        int subtree_size = 0;
+        Agg aggregate = Policy::AGG_ID;
+        Lazy lazy = Policy::LAZY_ID; // on a block: pending for every value in it
+        int height = 1;              // levels down to (and including) the blocks; one-child nodes add none
+        int refs = 1;                // owners: parent slots, tree roots and snapshots
+        atomic<unsigned> version{0}; // concurrent_reads: odd while a write holds the node; never reset
+        NodeArena* home = nullptr;   // the arena whose slab holds this node; never reset
+
+        bool is_block = false;  // leaf-parent: values live inline, no children
+        bool reversed = false;  // pending reversal of this subtree (aggregate already flipped)
+        bool stale = false;     // concurrent_writes: aggregate not yet redone after a latched write
+        Values values;          // block only, values[k] is the (k+1)-th element
+
+        BoundedArray<Node*> children; // nodes from the tree's NodeArena; internal nodes only
+
+        // prefix_sizes[k] = sum(children[0..k-1].subtree_size), kept exact at all times:
+        // structural changes rebuild it, single-element insert/erase patch the suffix.
+        BoundedArray<int> prefix_sizes;
+
+        explicit Node(int n = 0) : subtree_size(n) {}
+
+        void reset(int n) {
+            subtree_size = n;
+            aggregate = Policy::AGG_ID;
+            lazy = Policy::LAZY_ID;
+            height = 1;
+            refs = 1;
+            is_block = false;
+            reversed = false;
+            stale = false;
+            values.clear();
+            children.clear();
+            prefix_sizes.clear();
+        }
+
+        void rebuild_prefix_sizes() {
+            prefix_sizes.assign(children.size() + 1, 0);
+            for (int i = 0; i < (int)children.size(); ++i) {
+                prefix_sizes[i + 1] = prefix_sizes[i] + children[i]->subtree_size;
             }
+        }
 
-            int lc = choose_child_by_index(l, linear_cutoff);
-            int rc = choose_child_by_index(r, linear_cutoff);
-            rebuild_prefix_sizes();
+        // children[c] grew by delta: only the prefixes after it move.
+        void shift_prefix_sizes(int c, int delta) {
+            int* p = prefix_sizes.data();
+            for (int k = c + 1, n = (int)prefix_sizes.size(); k < n; ++k) p[k] += delta;
+        }
+
+        // Aggregate of the block's elements l..r (0-based, inclusive, in sequence
+        // order) with the block lazy and a pending reversal folded in.
+        Agg block_aggregate(int l, int r) const {
+            if (reversed) {
+                int n = (int)values.size();
+                int pl = n - 1 - r;
+                r = n - 1 - l;
+                l = pl;
+            }
+            Agg res = BlockOps<Policy>::reduce(values.data() + l, r - l + 1);
+            if (lazy != Policy::LAZY_ID) res = Policy::apply(res, lazy, r - l + 1);
+            return reversed ? reversed_aggregate<Policy>(res) : res;
+        }
+
+        // Position of the idx-th element (1-based) inside values.
+        int block_slot(int idx) const { return reversed ? (int)values.size() - idx : idx - 1; }
+
+        void pull() {
+            if (is_block) {
+                aggregate = values.empty() ? Policy::AGG_ID : block_aggregate(0, (int)values.size() - 1);
+                return;
+            }
+            Agg res = Policy::AGG_ID;
+            int h = 0;
+            for (auto c : children) {
+                res = Policy::combine(res, c->aggregate);
+                h = max(h, c->height);
+            }
+            aggregate = res;
+            height = h + (children.size() > 1 ? 1 : 0);
+        }
+
+        void apply_to_this_node(Lazy upd) {
+            aggregate = Policy::apply(aggregate, upd, subtree_size);
+            lazy = Policy::compose(lazy, upd);
+        }
+
+        void reverse_this_node() {
+            aggregate = reversed_aggregate<Policy>(aggregate);
+            reversed = !reversed;
+        }
+
+        // ---- Copy on write ----
+        // A node with refs > 1 is shared with a snapshot and is never written.
+        // Writers own the root and take every child they descend into through
+        // writable_child(), which copies it first if it is shared. A tag for a
+        // shared child does not copy it either: tag_child() wraps it in a
+        // one-child node holding the tag, and the copy is only made if a later
+        // write actually descends there.
+
+        // u itself if the caller holds its only reference, else a private copy
+        // (children are shared with the original, block values are copied).
+        static Node* own(Node* u, NodeArena& arena) {
+            if (u->refs == 1) return u;
+            Node* c = arena.make(u->subtree_size);
+            if (!u->is_block) arena.attach_table(c, u->children.capacity() == 1);
+            c->aggregate = u->aggregate;
+            c->lazy = u->lazy;
+            c->height = u->height;
+            c->is_block = u->is_block;
+            c->reversed = u->reversed;
+            c->values = u->values;
+            c->children = u->children;
+            c->prefix_sizes = u->prefix_sizes;
+            for (auto g : c->children) ++g->refs;
+            --u->refs;
+            return c;
+        }
+
+        static Node* wrap(Node* u, NodeArena& arena) {
+            Node* p = arena.make(u->subtree_size);
+            arena.attach_table(p, true);
+            p->children.push_back(u);
+            p->prefix_sizes.assign({0, u->subtree_size});
+            p->aggregate = u->aggregate;
+            p->height = u->height;
+            return p;
+        }
+
+        void tag_child(int c, Lazy upd, bool flip, NodeArena& arena) {
+            Node*& ch = children[c];
+            if (ch->refs > 1) {
+                bool wide = ch->is_block || ch->children.size() > 1;
+                ch = (wide && children.size() > 1) ? wrap(ch, arena) : own(ch, arena);
+            }
+            if (flip) ch->reverse_this_node();
+            if (upd != Policy::LAZY_ID) ch->apply_to_this_node(upd);
+        }
+
+        // children[c], owned and with any one-child wrapper folded into its child.
+        Node* writable_child(int c, NodeArena& arena) {
+            Node* ch = children[c] = own(children[c], arena);
+            while (!ch->is_block && ch->children.size() == 1) {
+                ch->push(arena);
+                children[c] = own(ch->children[0], arena);
+                arena.release(ch);
+                ch = children[c];
+            }
+            arena.lock(ch);
+            return ch;
+        }
+
+        void push(NodeArena& arena) {
+            if (!reversed && lazy == Policy::LAZY_ID) return;
+            arena.lock(this);
+            if (is_block) {
+                if (reversed) reverse(values.begin(), values.end());
+                if (lazy != Policy::LAZY_ID) BlockOps<Policy>::apply(values.data(), (int)values.size(), lazy);
+            } else {
+                if (reversed) reverse(children.begin(), children.end());
+                for (int c = 0; c < (int)children.size(); ++c) tag_child(c, lazy, reversed, arena);
+                if (reversed) rebuild_prefix_sizes();
+            }
+            reversed = false;
+            lazy = Policy::LAZY_ID;
+        }
+
+        int choose_child_by_index(int i_1_based, int linear_cutoff) const {
+            return route_child(prefix_sizes.data(), (int)children.size(), i_1_based, linear_cutoff);
+        }
+
+        static int route_child(const int* prefix, int n, int i_1_based, int linear_cutoff) {
+            return routing::route(prefix, n, i_1_based, linear_cutoff);
+        }
 
+        // Aggregate of [l, r] (1-based, clamped) without writing anything: every
+        // level folds its own pending lazy and reversal into what it returns, so
+        // it is safe on nodes shared with snapshots.
+        Agg read(int l, int r, int linear_cutoff) const {
+            l = max(l, 1);
+            r = min(r, subtree_size);
+            if (l > r) return Policy::AGG_ID;
+            if (l == 1 && r == subtree_size && !stale) return aggregate;
+            if (is_block) return block_aggregate(l - 1, r - 1);
+
+            int a = reversed ? subtree_size - r + 1 : l;
+            int b = reversed ? subtree_size - l + 1 : r;
+            int lc = choose_child_by_index(a, linear_cutoff);
+            int rc = choose_child_by_index(b, linear_cutoff);
+            Agg res;
             if (lc == rc) {
-                return children[lc]->range_query(l - prefix_sizes[lc], r - prefix_sizes[lc], linear_cutoff);
+                res = children[lc]->read(a - prefix_sizes[lc], b - prefix_sizes[lc], linear_cutoff);
+            } else {
+                res = children[lc]->read(a - prefix_sizes[lc], children[lc]->subtree_size, linear_cutoff);
+                for (int i = lc + 1; i < rc; ++i) {
+                    const Node* c = children[i];
+                    res = Policy::combine(res, c->stale ? c->read(1, c->subtree_size, linear_cutoff) : c->aggregate);
+                }
+                res = Policy::combine(res, children[rc]->read(1, b - prefix_sizes[rc], linear_cutoff));
             }
+            if (lazy != Policy::LAZY_ID) res = Policy::apply(res, lazy, r - l + 1);
+            return reversed ? reversed_aggregate<Policy>(res) : res;
+        }
 
-            Agg res = children[lc]->range_query(l - prefix_sizes[lc], children[lc]->subtree_size, linear_cutoff);
-            for (int i = lc + 1; i < rc; ++i) res = Policy::combine(res, children[i]->aggregate);
-            res = Policy::combine(res, children[rc]->range_query(1, r - prefix_sizes[rc], linear_cutoff));
-            return res;
+        // A tag from the parent does not lock the child, so a node's fields are
+        // checked against the parent's version as well as its own; writes that
+        // reshape the tree lock none of it and are caught by the tree's version.
+        bool unchanged(unsigned v, const Node* up, unsigned uv, const OptimisticRead& rd) const {
+            atomic_thread_fence(memory_order_acquire);
+            return version.load(memory_order_relaxed) == v &&
+                   (!up || up->version.load(memory_order_relaxed) == uv) &&
+                   rd.tree_version->load(memory_order_relaxed) == rd.seen;
+        }
+
+        // read() for concurrent_query, racing one writer: v is the (even) version
+        // the caller saw, up and uv the parent and the version it was read at.
+        // Fields are copied, then checked before any is trusted; a child's version
+        // is read before this node is re-checked, so a child changed later fails
+        // its own check, and the whole read sees the tree as it was when the root
+        // was first checked. Returns false on any conflict. Tables and nodes live
+        // in the arena for the tree's lifetime, so stale pointers stay readable; a
+        // block's values may be reallocated under the reader, but the old buffer
+        // is retired until the reader leaves (ReaderEpochs), and what it read is
+        // dropped by the check that follows. The copies race with the writer by
+        // design, as in any seqlock, so race detectors report them.
+        bool read_optimistic(int l, int r, const OptimisticRead& rd, unsigned v, const Node* up, unsigned uv,
+                             Agg& out) const {
+            int sz = subtree_size;
+            Agg agg = aggregate;
+            Lazy lz = lazy;
+            bool rev = reversed, blk = is_block;
+            const Agg* vals = values.data();
+            int vn = (int)values.size();
+            Node* const* kids = children.data();
+            const int* pre = prefix_sizes.data();
+            int kn = (int)children.size();
+            if (!unchanged(v, up, uv, rd)) return false;
+
+            l = max(l, 1);
+            r = min(r, sz);
+            if (l > r) {
+                out = Policy::AGG_ID;
+                return true;
+            }
+            if (l == 1 && r == sz) {
+                out = agg;
+                return true;
+            }
+
+            Agg res;
+            if (blk) {
+                if (!vals || vn != sz) return false;
+                int lo = rev ? sz - r : l - 1;
+                res = BlockOps<Policy>::reduce(vals + lo, r - l + 1);
+                if (!unchanged(v, up, uv, rd)) return false;
+            } else {
+                if (!kids || !pre || kn <= 0) return false;
+                int a = rev ? sz - r + 1 : l;
+                int b = rev ? sz - l + 1 : r;
+                int lc = route_child(pre, kn, a, rd.linear_cutoff);
+                int rc = route_child(pre, kn, b, rd.linear_cutoff);
+                const Node* cl = kids[lc];
+                const Node* cr = kids[rc];
+                int pl = pre[lc], pr = pre[rc];
+                Agg mid = Policy::AGG_ID;
+                for (int i = lc + 1; i < rc; ++i) {
+                    const Node* c = kids[i];
+                    if (!c) return false;
+                    mid = Policy::combine(mid, c->aggregate);
+                }
+                if (!cl || !cr) return false;
+                unsigned vl = cl->version.load(memory_order_acquire);
+                unsigned vr = cr->version.load(memory_order_acquire);
+                if (((vl | vr) & 1) || !unchanged(v, up, uv, rd)) return false;
+
+                if (lc == rc) {
+                    if (!cl->read_optimistic(a - pl, b - pl, rd, vl, this, v, res)) return false;
+                } else {
+                    Agg left, right;
+                    if (!cl->read_optimistic(a - pl, INT_MAX, rd, vl, this, v, left)) return false;
+                    if (!cr->read_optimistic(1, b - pr, rd, vr, this, v, right)) return false;
+                    res = Policy::combine(Policy::combine(left, mid), right);
+                }
+            }
+            if (lz != Policy::LAZY_ID) res = Policy::apply(res, lz, r - l + 1);
+            out = rev ? reversed_aggregate<Policy>(res) : res;
+            return true;
         }
 
-        void range_apply(int l, int r, Lazy upd, int linear_cutoff) {
-            if (children.empty() || l > subtree_size || r < 1) return;
+        void range_apply(int l, int r, Lazy upd, int linear_cutoff, NodeArena& arena) {
+            if (subtree_size == 0 || l > subtree_size || r < 1) return;
             l = max(l, 1);
             r = min(r, subtree_size);
             if (l > r) return;
+            arena.lock(this);
 
             if (l == 1 && r == subtree_size) {
                 apply_to_this_node(upd);
                 return;
             }
 
-            push();
+            push(arena);
 
-            if (is_leaf_level_parent()) {
-                for (int i = l; i <= r; ++i) children[i - 1]->apply_to_this_node(upd);
+            if (is_block) {
+                BlockOps<Policy>::apply(values.data() + (l - 1), r - l + 1, upd);
                 pull();
                 return;
             }
 
             int lc = choose_child_by_index(l, linear_cutoff);
             int rc = choose_child_by_index(r, linear_cutoff);
-            rebuild_prefix_sizes();
 
             for (int i = lc; i <= rc; ++i) {
                 int L = max(1, l - prefix_sizes[i]);
                 int R = min(children[i]->subtree_size, r - prefix_sizes[i]);
-                if (L <= R) children[i]->range_apply(L, R, upd, linear_cutoff);
+                if (L > R) continue;
+                if (L == 1 && R == children[i]->subtree_size) {
+                    tag_child(i, upd, false, arena);
+                } else {
+                    writable_child(i, arena)->range_apply(L, R, upd, linear_cutoff, arena);
+                }
             }
             pull();
         }
 
-        void point_set(int idx, Agg value, int linear_cutoff) {
-            if (children.empty() || idx < 1 || idx > subtree_size) return;
-            push();
+        void point_set(int idx, Agg value, int linear_cutoff, NodeArena& arena) {
+            if (subtree_size == 0 || idx < 1 || idx > subtree_size) return;
+            arena.lock(this);
+            push(arena);
 
-            if (is_leaf_level_parent()) {
-                children[idx - 1]->aggregate = value;
+            if (is_block) {
+                values[idx - 1] = value;
                 pull();
                 return;
             }
 
             int c = choose_child_by_index(idx, linear_cutoff);
-            rebuild_prefix_sizes();
-            children[c]->point_set(idx - prefix_sizes[c], value, linear_cutoff);
+            writable_child(c, arena)->point_set(idx - prefix_sizes[c], value, linear_cutoff, arena);
             pull();
         }
 
-        // Split the node into children according to a branching factor s.
-        void build_skeleton(int leaf_threshold, const SmallestPrimeFactorSieve& spf_sieve, int max_spf) {
-            if (subtree_size <= leaf_threshold) {
-                children.reserve(subtree_size);
-                for (int i = 0; i < subtree_size; ++i) children.push_back(make_unique<Node>(1));
-                mark_prefix_dirty();
+        // ---- Lock coupling (concurrent_writes) ----
+        // version doubles as the latch: odd while a writer holds the node. A
+        // writer latches a child before it lets go of the parent, so writes on a
+        // shared path stay in order and never overtake each other below it.
+
+        void latch() {
+            for (;;) {
+                unsigned v = version.load(memory_order_relaxed);
+                if (!(v & 1) && version.compare_exchange_weak(v, v + 1, memory_order_acquire)) return;
+                this_thread::yield();
+            }
+        }
+
+        void unlatch() { version.store(version.load(memory_order_relaxed) + 1, memory_order_release); }
+
+        // children[c], latched and owned; this node is latched. A copy taken off
+        // a snapshot is new, so latching it never waits.
+        Node* latch_child(int c, NodeArena& arena) {
+            Node* ch = children[c];
+            ch->latch();
+            if (ch->refs > 1) {
+                lock_guard<recursive_mutex> alloc(arena.alloc_mutex());
+                Node* copy = own(ch, arena);
+                copy->latch();
+                ch->unlatch();
+                children[c] = ch = copy;
+            }
+            return ch;
+        }
+
+        // tag_child for a child another writer may be below.
+        void tag_latched(int c, Lazy upd, bool flip, NodeArena& arena) {
+            Node* ch = children[c];
+            ch->latch();
+            unique_lock<recursive_mutex> alloc(arena.alloc_mutex(), defer_lock);
+            if (ch->refs > 1) alloc.lock();
+            tag_child(c, upd, flip, arena);
+            ch->unlatch();
+        }
+
+        void push_latched(NodeArena& arena) {
+            if (is_block || (!reversed && lazy == Policy::LAZY_ID)) {
+                push(arena);
+                return;
+            }
+            if (reversed) reverse(children.begin(), children.end());
+            for (int c = 0; c < (int)children.size(); ++c) tag_latched(c, lazy, reversed, arena);
+            if (reversed) rebuild_prefix_sizes();
+            reversed = false;
+            lazy = Policy::LAZY_ID;
+        }
+
+        // point_set entered with this node latched. Each level is let go once the
+        // next one is latched, and is only marked stale: its aggregate waits for
+        // refresh_stale(), which is what lets the levels above go early.
+        void point_set_latched(int idx, Agg value, int linear_cutoff, NodeArena& arena) {
+            Node* u = this;
+            while (!u->is_block) {
+                u->push_latched(arena);
+                u->stale = true;
+                int c = u->choose_child_by_index(idx, linear_cutoff);
+                idx -= u->prefix_sizes[c];
+                Node* ch = u->latch_child(c, arena);
+                u->unlatch();
+                u = ch;
+            }
+            u->push(arena);
+            u->values[idx - 1] = value;
+            u->pull();
+            u->unlatch();
+        }
+
+        // range_apply the same way, [l, r] already clipped: children it covers are
+        // tagged under their own latch, the (at most two) it cuts into are latched
+        // before this node is let go and then entered one after the other.
+        void range_apply_latched(int l, int r, Lazy upd, int linear_cutoff, NodeArena& arena) {
+            if (l == 1 && r == subtree_size) {
+                apply_to_this_node(upd);
+                unlatch();
+                return;
+            }
+            push_latched(arena);
+            if (is_block) {
+                BlockOps<Policy>::apply(values.data() + (l - 1), r - l + 1, upd);
                 pull();
+                unlatch();
                 return;
             }
 
-            auto get_branch = [&](int n) -> int {
-                if (n <= leaf_threshold) return n;
-                if (n <= max_spf) {
-                    int x = spf_sieve[n];
-                    return (x > leaf_threshold ? 2 : x);
+            stale = true;
+            int lc = choose_child_by_index(l, linear_cutoff);
+            int rc = choose_child_by_index(r, linear_cutoff);
+            Node* cut[2];
+            int cl[2], cr[2], m = 0;
+            for (int i = lc; i <= rc; ++i) {
+                int L = max(1, l - prefix_sizes[i]);
+                int R = min(children[i]->subtree_size, r - prefix_sizes[i]);
+                if (L > R) continue;
+                if (L == 1 && R == children[i]->subtree_size) {
+                    tag_latched(i, upd, false, arena);
+                } else {
+                    cut[m] = latch_child(i, arena);
+                    cl[m] = L;
+                    cr[m++] = R;
                 }
-                return 2; // conservative fallback
-            };
+            }
+            unlatch();
+            for (int k = 0; k < m; ++k) cut[k]->range_apply_latched(cl[k], cr[k], upd, linear_cutoff, arena);
+        }
 
-            int s = get_branch(subtree_size);
-            int g = subtree_size / s, r = subtree_size % s;
+        // Redoes the aggregates latched writes left stale, children first (every
+        // ancestor of a stale node is stale). A node may have been tagged since it
+        // was marked, so its own pending lazy and reversal are folded back in.
+        static void refresh_stale(Node* u) {
+            if (!u->stale) return;
+            Agg res = Policy::AGG_ID;
+            for (Node* c : u->children) {
+                refresh_stale(c);
+                res = Policy::combine(res, c->aggregate);
+            }
+            if (u->lazy != Policy::LAZY_ID) res = Policy::apply(res, u->lazy, u->subtree_size);
+            u->aggregate = u->reversed ? reversed_aggregate<Policy>(res) : res;
+            u->stale = false;
+        }
 
-            children.reserve(s);
-            for (int i = 0; i < s; ++i) {
-                int child_sz = g + (i == s - 1 ? r : 0);
-                auto child = make_unique<Node>(child_sz);
-                child->build_skeleton(leaf_threshold, spf_sieve, max_spf);
-                children.push_back(std::move(child));
+        // A batch op restricted to this subtree: [l, r] is relative and clipped.
+        struct BatchItem {
+            int op, l, r;
+        };
+
+        // Runs items in batch order. Ops that land in different children touch
+        // disjoint elements and commute, so between two ops covering the whole
+        // node the rest are stably bucketed per child and each child is entered
+        // once; only whole-node ops act as barriers. The top fork_depth levels
+        // hand their children to pool.
+        void run_batch(BatchItem* items, int n, const BatchOp* ops, Agg* results, int linear_cutoff,
+                       NodeArena& arena, WorkStealingPool* pool = nullptr, int fork_depth = 0) {
+            if (is_block) {
+                run_batch_on_block(items, n, ops, results, arena);
+                return;
+            }
+            for (int i = 0; i < n;) {
+                int j = i;
+                while (j < n && !covers_node(items[j], ops)) ++j;
+                if (j > i && fork_depth > 0)
+                    fork_batch_in_children(items + i, j - i, ops, results, linear_cutoff, arena, *pool, fork_depth);
+                else if (j > i)
+                    run_batch_in_children(items + i, j - i, ops, results, linear_cutoff, arena);
+                for (; j < n && covers_node(items[j], ops); ++j) {
+                    const BatchOp& op = ops[items[j].op];
+                    if (op.kind == BatchOp::RangeQuery)
+                        results[items[j].op] = Policy::combine(results[items[j].op], aggregate);
+                    else
+                        apply_to_this_node(op.delta);
+                }
+                i = j;
+            }
+        }
+
+        bool covers_node(const BatchItem& it, const BatchOp* ops) const {
+            return it.l == 1 && it.r == subtree_size && ops[it.op].kind != BatchOp::PointSet;
+        }
+
+        void run_batch_in_children(BatchItem* items, int n, const BatchOp* ops, Agg* results, int linear_cutoff,
+                                   NodeArena& arena) {
+            push(arena);
+            vector<BatchItem> sorted;
+            vector<int> start;
+            bucket_by_child(items, n, linear_cutoff, sorted, start);
+            for (int c = 0; c < (int)children.size(); ++c) {
+                if (start[c] == start[c + 1]) continue;
+                writable_child(c, arena)->run_batch(sorted.data() + start[c], start[c + 1] - start[c],
+                                                    ops, results, linear_cutoff, arena);
+            }
+            pull();
+        }
+
+        // Same, with each child a task on pool. Pieces of one query in two
+        // children must not share a result slot, so every task gets its own copy
+        // of the ops it sees; query pieces are folded back in child order after
+        // the join, as the walk above would fold them. Children are made writable
+        // first, on this thread: that is where copies off snapshots happen.
+        void fork_batch_in_children(BatchItem* items, int n, const BatchOp* ops, Agg* results, int linear_cutoff,
+                                    NodeArena& arena, WorkStealingPool& pool, int fork_depth) {
+            push(arena);
+            vector<BatchItem> sorted;
+            vector<int> start;
+            bucket_by_child(items, n, linear_cutoff, sorted, start);
+            int m = (int)sorted.size();
+            vector<int> origin(m);
+            for (int t = 0; t < m; ++t) origin[t] = sorted[t].op;
+            vector<BatchOp> sub_ops(m);
+            vector<Agg> sub_results(m, Policy::AGG_ID);
+            WorkStealingPool::Join join;
+            for (int c = 0; c < (int)children.size(); ++c) {
+                if (start[c] == start[c + 1]) continue;
+                Node* ch = writable_child(c, arena);
+                pool.spawn(join, [&, ch, c] {
+                    for (int t = start[c]; t < start[c + 1]; ++t) {
+                        sub_ops[t] = ops[origin[t]];
+                        sorted[t].op = t;
+                    }
+                    ch->run_batch(sorted.data() + start[c], start[c + 1] - start[c], sub_ops.data(),
+                                  sub_results.data(), linear_cutoff, arena, &pool, fork_depth - 1);
+                });
+            }
+            pool.wait(join);
+            for (int t = 0; t < m; ++t) {
+                if (ops[origin[t]].kind == BatchOp::RangeQuery)
+                    results[origin[t]] = Policy::combine(results[origin[t]], sub_results[t]);
             }
-            mark_prefix_dirty();
             pull();
         }
 
-        // If this node currently directly holds N leaves (children with no children),
-        // regroup those leaves into fewer intermediate nodes (reduces degree).
+        // Splits items over the children they reach: child c gets
+        // sorted[start[c], start[c + 1]), in batch order (a counting sort).
+        void bucket_by_child(const BatchItem* items, int n, int linear_cutoff, vector<BatchItem>& sorted,
+                             vector<int>& start) const {
+            int k = (int)children.size();
+            vector<pair<int, BatchItem>> pieces;
+            for (int i = 0; i < n; ++i) {
+                int lc = choose_child_by_index(items[i].l, linear_cutoff);
+                int rc = choose_child_by_index(items[i].r, linear_cutoff);
+                for (int c = lc; c <= rc; ++c) {
+                    int L = max(1, items[i].l - prefix_sizes[c]);
+                    int R = min(children[c]->subtree_size, items[i].r - prefix_sizes[c]);
+                    if (L <= R) pieces.push_back({c, {items[i].op, L, R}});
+                }
+            }
+            start.assign(k + 1, 0);
+            for (auto& p : pieces) ++start[p.first + 1];
+            for (int c = 0; c < k; ++c) start[c + 1] += start[c];
+            sorted.resize(pieces.size());
+            vector<int> fill(start.begin(), start.end() - 1);
+            for (auto& p : pieces) sorted[fill[p.first]++] = p.second;
+        }
+
+        // Writes go straight to values and the block is re-aggregated once at the
+        // end (or before a whole-block op needs the aggregate).
+        void run_batch_on_block(BatchItem* items, int n, const BatchOp* ops, Agg* results, NodeArena& arena) {
+            bool dirty = false;
+            for (int i = 0; i < n; ++i) {
+                const BatchItem& it = items[i];
+                const BatchOp& op = ops[it.op];
+                bool whole = it.l == 1 && it.r == subtree_size;
+                switch (op.kind) {
+                    case BatchOp::RangeQuery:
+                        results[it.op] = Policy::combine(
+                            results[it.op], whole && !dirty ? aggregate : block_aggregate(it.l - 1, it.r - 1));
+                        break;
+                    case BatchOp::RangeApply:
+                        if (whole) {
+                            if (dirty) pull();
+                            dirty = false;
+                            apply_to_this_node(op.delta);
+                        } else {
+                            push(arena);
+                            BlockOps<Policy>::apply(values.data() + (it.l - 1), it.r - it.l + 1, op.delta);
+                            dirty = true;
+                        }
+                        break;
+                    case BatchOp::PointSet:
+                        push(arena);
+                        values[it.l - 1] = op.value;
+                        dirty = true;
+                        break;
+                }
+            }
+            if (dirty) pull();
+        }
+
+        static Node* make_block(const Agg* a, int cnt, NodeArena& arena) {
+            Node* b = arena.make(cnt);
+            b->is_block = true;
+            b->values.assign(a, a + cnt);
+            b->pull();
+            return b;
+        }
+
+        static Node* make_parent(Node* const* kids, int cnt, NodeArena& arena) {
+            Node* p = arena.make(0);
+            arena.attach_table(p);
+            p->children.assign(kids, kids + cnt);
+            p->prefix_sizes.resize(cnt + 1);
+            p->prefix_sizes[0] = 0;
+            Agg res = Policy::AGG_ID;
+            int h = 0;
+            for (int i = 0; i < cnt; ++i) {
+                p->prefix_sizes[i + 1] = p->prefix_sizes[i] + kids[i]->subtree_size;
+                res = Policy::combine(res, kids[i]->aggregate);
+                h = max(h, kids[i]->height);
+            }
+            p->subtree_size = p->prefix_sizes[cnt];
+            p->aggregate = res;
+            p->height = h + (cnt > 1 ? 1 : 0);
+            return p;
+        }
+
+        // Bottom-up build in one pass: a[0..n) is laid straight into ceil(n / T)
+        // even blocks, then every level groups ceil(m / T) even parents over the
+        // previous one, so sizes, prefixes and aggregates are computed once.
+        static Node* build_balanced(const Agg* a, int n, int leaf_threshold, NodeArena& arena) {
+            int t = max(2, leaf_threshold);
+            int blocks = (n + t - 1) / t;
+            vector<Node*> level;
+            level.reserve(blocks);
+            for (int i = 0, pos = 0; i < blocks; ++i) {
+                int cnt = n / blocks + (i < n % blocks ? 1 : 0);
+                level.push_back(make_block(a + pos, cnt, arena));
+                pos += cnt;
+            }
+            return stack_levels(level, t, arena);
+        }
+
+        static Node* stack_levels(vector<Node*>& level, int t, NodeArena& arena) {
+            while (level.size() > 1) {
+                int m = (int)level.size();
+                int parents = (m + t - 1) / t;
+                for (int i = 0, pos = 0; i < parents; ++i) {
+                    int cnt = m / parents + (i < m % parents ? 1 : 0);
+                    level[i] = make_parent(level.data() + pos, cnt, arena);
+                    pos += cnt;
+                }
+                level.resize(parents);
+            }
+            return level[0];
+        }
+
+        // If this block grew too wide, cut its values into smaller blocks
+        // below a new intermediate level (reduces degree).
         bool split_leaf_level_if_needed(int leaf_threshold,
                                        const SmallestPrimeFactorSieve& spf_sieve,
-                                       int max_spf) {
-            if (children.empty() || !is_leaf_level_parent()) return false;
-            int n = (int)children.size();
+                                       int max_spf,
+                                       NodeArena& arena) {
+            if (!is_block) return false;
+            int n = (int)values.size();
             if (n <= leaf_threshold) return false;
             if (n <= 4 * leaf_threshold) return false;
 
@@ -377,148 +2104,1595 @@ private:
                 return 2;
             };
 
-            vector<unique_ptr<Node>> old;
-            old.swap(children);
-
+            push(arena);
             int s = get_branch(n);
             int g = n / s, r = n % s;
 
-            children.reserve(s);
+            arena.attach_table(this);
             int idx = 0;
             for (int i = 0; i < s; ++i) {
                 int cnt = g + (i == s - 1 ? r : 0);
-                auto mid = make_unique<Node>(0);
-                mid->children.reserve(cnt);
-
-                for (int j = 0; j < cnt; ++j) {
-                    mid->children.push_back(std::move(old[idx++]));
-                    mid->subtree_size += mid->children.back()->subtree_size;
-                }
-                mid->mark_prefix_dirty();
+                Node* mid = arena.make(cnt);
+                mid->is_block = true;
+                mid->values.assign(values.begin() + idx, values.begin() + idx + cnt);
+                idx += cnt;
                 mid->pull();
-                children.push_back(std::move(mid));
+                children.push_back(mid);
             }
 
-            subtree_size = 0;
-            for (auto& c : children) subtree_size += c->subtree_size;
-            mark_prefix_dirty();
+            is_block = false;
+            values.clear();
+            values.shrink_to_fit();
+            rebuild_prefix_sizes();
             pull();
             return true;
         }
 
-        bool insert_at(int idx, Agg value, int linear_cutoff,
-                       int leaf_threshold, const SmallestPrimeFactorSieve& spf_sieve, int max_spf) {
+        void insert_at(int idx, Agg value, int linear_cutoff,
+                       int leaf_threshold, const SmallestPrimeFactorSieve& spf_sieve, int max_spf,
+                       int height_slack, NodeArena& arena) {
             idx = max(1, min(idx, subtree_size + 1));
-            push();
+            arena.lock(this);
+            push(arena);
             ++subtree_size;
 
-            if (is_leaf_level_parent()) {
-                auto leaf = make_unique<Node>(1);
-                leaf->aggregate = value;
-
-                int pos = min((int)children.size(), idx - 1);
-                children.insert(children.begin() + pos, std::move(leaf));
-                mark_prefix_dirty();
+            if (is_block) {
+                int pos = min((int)values.size(), idx - 1);
+                values.insert(values.begin() + pos, value);
                 pull();
 
-                return split_leaf_level_if_needed(leaf_threshold, spf_sieve, max_spf);
+                split_leaf_level_if_needed(leaf_threshold, spf_sieve, max_spf, arena);
+                return;
             }
 
             int c = choose_child_by_index(idx, linear_cutoff);
-            rebuild_prefix_sizes();
-            bool did_split = children[c]->insert_at(idx - prefix_sizes[c], value,
-                                                   linear_cutoff, leaf_threshold, spf_sieve, max_spf);
-            mark_prefix_dirty();
+            Node* ch = writable_child(c, arena);
+            ch->insert_at(idx - prefix_sizes[c], value,
+                          linear_cutoff, leaf_threshold, spf_sieve, max_spf, height_slack, arena);
+            // Scapegoat step: the deepest subtree that outgrew its height budget is
+            // rebuilt on the way back up, so only the hot region pays for it.
+            if (ch->height > height_budget(ch->subtree_size, leaf_threshold, height_slack)) {
+                children[c] = rebuild_subtree(ch, leaf_threshold, arena);
+            }
+            shift_prefix_sizes(c, +1);
+            pull();
+        }
+
+        // Splices a[0..k) in before position idx. A run that fits in one block is
+        // inserted into the block it lands in; a longer one is built as its own
+        // balanced subtree and hung between the two halves of that block.
+        void insert_range(int idx, const Agg* a, int k, int linear_cutoff,
+                          int leaf_threshold, const SmallestPrimeFactorSieve& spf_sieve, int max_spf,
+                          int height_slack, NodeArena& arena) {
+            idx = max(1, min(idx, subtree_size + 1));
+            push(arena);
+            subtree_size += k;
+
+            if (is_block) {
+                int pos = min((int)values.size(), idx - 1);
+                if (k <= max(1, leaf_threshold)) {
+                    values.insert(values.begin() + pos, a, a + k);
+                    pull();
+                    split_leaf_level_if_needed(leaf_threshold, spf_sieve, max_spf, arena);
+                    return;
+                }
+                int tail = (int)values.size() - pos;
+                arena.attach_table(this);
+                if (pos > 0) children.push_back(make_block(values.data(), pos, arena));
+                children.push_back(build_balanced(a, k, leaf_threshold, arena));
+                if (tail > 0) children.push_back(make_block(values.data() + pos, tail, arena));
+                Values().swap(values);
+                is_block = false;
+                rebuild_prefix_sizes();
+                pull();
+                return;
+            }
+
+            int c = choose_child_by_index(idx, linear_cutoff);
+            Node* ch = writable_child(c, arena);
+            ch->insert_range(idx - prefix_sizes[c], a, k,
+                             linear_cutoff, leaf_threshold, spf_sieve, max_spf, height_slack, arena);
+            if (ch->height > height_budget(ch->subtree_size, leaf_threshold, height_slack)) {
+                children[c] = rebuild_subtree(ch, leaf_threshold, arena);
+            }
+            shift_prefix_sizes(c, +k);
             pull();
-            return did_split;
         }
 
-        void erase_at(int idx, int linear_cutoff) {
-            if (children.empty() || idx < 1 || idx > subtree_size) return;
-            push();
+        // Inserts k (position, value) pairs sorted by position, where position p
+        // means p - shift in u as it was before the call, with one descent per
+        // touched node: the pairs are cut into one run per child and a block
+        // takes its run in a single merge. Returns the node that replaces u.
+        static Node* insert_many(Node* u, const pair<int, Agg>* items, int k, int shift, int linear_cutoff,
+                                 int leaf_threshold, int height_slack, NodeArena& arena) {
+            u->push(arena);
+            if (u->is_block) {
+                int m = u->subtree_size;
+                Values merged;
+                merged.reserve(m + k);
+                for (int i = 0, j = 0; i <= m; ++i) {
+                    while (j < k && items[j].first - shift <= i + 1) merged.push_back(items[j++].second);
+                    if (i < m) merged.push_back(u->values[i]);
+                }
+                // Same bound split_leaf_level_if_needed allows a block to grow to.
+                if ((int)merged.size() <= 4 * max(1, leaf_threshold)) {
+                    u->values.swap(merged);
+                    u->subtree_size = (int)u->values.size();
+                    u->pull();
+                    return u;
+                }
+                arena.release(u);
+                return build_balanced(merged.data(), (int)merged.size(), leaf_threshold, arena);
+            }
+
+            int n = u->subtree_size;
+            int last = (int)u->children.size() - 1;
+            for (int j = 0; j < k;) {
+                int p = items[j].first - shift;
+                int c = p > n ? last : u->choose_child_by_index(p, linear_cutoff);
+                int e = j + 1;
+                if (c == last) {
+                    e = k;
+                } else {
+                    while (e < k && items[e].first - shift <= u->prefix_sizes[c + 1]) ++e;
+                }
+                Node* ch = insert_many(u->writable_child(c, arena), items + j, e - j, shift + u->prefix_sizes[c],
+                                       linear_cutoff, leaf_threshold, height_slack, arena);
+                if (ch->height > height_budget(ch->subtree_size, leaf_threshold, height_slack)) {
+                    ch = rebuild_subtree(ch, leaf_threshold, arena);
+                }
+                u->children[c] = ch;
+                j = e;
+            }
+            u->subtree_size += k;
+            u->rebuild_prefix_sizes();
+            u->pull();
+            return u;
+        }
+
+        // Height of an even tree with fanout t over n elements, plus the allowed slack.
+        static int height_budget(int n, int t, int slack) {
+            t = max(2, t);
+            int h = 1;
+            for (long long cap = t; cap < n; cap *= t) ++h;
+            return h + slack;
+        }
+
+        static Node* rebuild_subtree(Node* u, int leaf_threshold, NodeArena& arena) {
+            vector<Node*> blocks;
+            release_into_blocks(u, blocks, arena);
+            int t = max(2, leaf_threshold);
+            repack_blocks(blocks, t, arena);
+            return stack_levels(blocks, t, arena);
+        }
+
+        void erase_at(int idx, int linear_cutoff, int leaf_threshold, NodeArena& arena) {
+            if (subtree_size == 0 || idx < 1 || idx > subtree_size) return;
+            arena.lock(this);
 
-            if (is_leaf_level_parent()) {
-                int p = idx - 1;
-                children.erase(children.begin() + p);
+            if (is_block) {
+                // Dropping a value does not disturb the others, so the block lazy can stay.
+                values.erase(values.begin() + block_slot(idx));
                 --subtree_size;
-                mark_prefix_dirty();
                 pull();
                 return;
             }
 
+            push(arena);
             int c = choose_child_by_index(idx, linear_cutoff);
-            rebuild_prefix_sizes();
 
-            children[c]->erase_at(idx - prefix_sizes[c], linear_cutoff);
-            if (children[c]->subtree_size == 0) children.erase(children.begin() + c);
+            writable_child(c, arena)->erase_at(idx - prefix_sizes[c], linear_cutoff, leaf_threshold, arena);
+            shift_prefix_sizes(c, -1);
+            if (children[c]->subtree_size == 0) {
+                arena.release(children[c]);
+                children.erase(children.begin() + c);
+                prefix_sizes.erase(prefix_sizes.begin() + c + 1);
+            } else {
+                fix_underflow(c, leaf_threshold, arena);
+            }
 
             --subtree_size;
-            mark_prefix_dirty();
             pull();
         }
 
-        void collect_values(vector<Agg>& out) {
-            if (children.empty()) return;
-            push();
-            if (is_leaf_level_parent()) {
-                for (auto& c : children) out.push_back(c->aggregate);
-            } else {
-                for (auto& c : children) c->collect_values(out);
+        // Removes [l, r]: children lying fully inside are released whole, only the
+        // (at most two) boundary children are descended into and then repaired.
+        void erase_range(int l, int r, int linear_cutoff, int leaf_threshold, NodeArena& arena) {
+            l = max(l, 1);
+            r = min(r, subtree_size);
+            if (l > r) return;
+
+            if (is_block) {
+                int lo = min(block_slot(l), block_slot(r));
+                values.erase(values.begin() + lo, values.begin() + lo + (r - l + 1));
+                subtree_size -= r - l + 1;
+                pull();
+                return;
             }
+
+            push(arena);
+            int lc = choose_child_by_index(l, linear_cutoff);
+            int rc = choose_child_by_index(r, linear_cutoff);
+            int kept = lc;
+            vector<int> boundary;
+            for (int c = lc; c <= rc; ++c) {
+                int L = max(1, l - prefix_sizes[c]);
+                int R = min(children[c]->subtree_size, r - prefix_sizes[c]);
+                if (L == 1 && R == children[c]->subtree_size) {
+                    release_subtree(children[c], arena);
+                    continue;
+                }
+                Node* ch = writable_child(c, arena);
+                ch->erase_range(L, R, linear_cutoff, leaf_threshold, arena);
+                boundary.push_back(kept);
+                children[kept++] = ch;
+            }
+            children.erase(children.begin() + kept, children.begin() + rc + 1);
+            subtree_size -= r - l + 1;
+            rebuild_prefix_sizes();
+            // Right boundary first: repairing it can only shift indices to its right.
+            for (int i = (int)boundary.size() - 1; i >= 0; --i) fix_underflow(boundary[i], leaf_threshold, arena);
+            pull();
         }
 
-        void fill_from_array(const vector<Agg>& a, int& i) {
-            if (children.empty()) return;
-            if (!is_leaf_level_parent()) {
-                for (auto& c : children) c->fill_from_array(a, i);
+        // Reverses [l, r]. A range inside one child is passed down; a range over
+        // several children is first cut at both ends (the boundary children are
+        // split) so it becomes a run of whole children, which is flipped in place
+        // with each child tagged. Heights never grow; the two cuts widen this node,
+        // and a node that gets too wide is rebuilt by its parent.
+        void range_reverse(int l, int r, int linear_cutoff, int leaf_threshold, NodeArena& arena) {
+            l = max(l, 1);
+            r = min(r, subtree_size);
+            if (l >= r) return;
+            if (l == 1 && r == subtree_size) {
+                reverse_this_node();
+                return;
+            }
+
+            push(arena);
+            if (is_block) {
+                reverse(values.begin() + (l - 1), values.begin() + r);
+                pull();
+                return;
+            }
+
+            int lc = choose_child_by_index(l, linear_cutoff);
+            int rc = choose_child_by_index(r, linear_cutoff);
+            if (lc == rc) {
+                Node* ch = writable_child(lc, arena);
+                ch->range_reverse(l - prefix_sizes[lc], r - prefix_sizes[lc], linear_cutoff, leaf_threshold, arena);
+                if (too_wide(ch, leaf_threshold)) children[lc] = rebuild_subtree(ch, leaf_threshold, arena);
                 pull();
-                mark_prefix_dirty();
                 return;
             }
-            for (auto& c : children) {
-                if (i < (int)a.size()) c->aggregate = a[i++];
+
+            int keep = r - prefix_sizes[rc];
+            if (keep < children[rc]->subtree_size) {
+                auto cut = split(writable_child(rc, arena), keep, linear_cutoff, leaf_threshold, arena);
+                children[rc] = cut.first;
+                children.insert(children.begin() + rc + 1, cut.second);
+            }
+            int skip = l - 1 - prefix_sizes[lc];
+            if (skip > 0) {
+                auto cut = split(writable_child(lc, arena), skip, linear_cutoff, leaf_threshold, arena);
+                children[lc] = cut.first;
+                children.insert(children.begin() + lc + 1, cut.second);
+                ++lc;
+                ++rc;
+            }
+            reverse(children.begin() + lc, children.begin() + rc + 1);
+            for (int c = lc; c <= rc; ++c) tag_child(c, Policy::LAZY_ID, true, arena);
+            rebuild_prefix_sizes();
+            // Small pieces at the two seams merge with their neighbours (right first,
+            // a repair only moves indices to its right).
+            for (int c : {rc + 1, rc, lc, lc - 1}) {
+                if (0 <= c && c < (int)children.size()) fix_underflow(c, leaf_threshold, arena);
             }
             pull();
-            mark_prefix_dirty();
         }
-    };
 
-private:
-    void build_from_array(const vector<Agg>& a) {
-        int n = (int)a.size();
-        if (n == 0) {
-            root_.reset();
-            return;
+        static bool too_wide(const Node* u, int leaf_threshold) {
+            return !u->is_block && (int)u->children.size() > 4 * max(2, leaf_threshold);
         }
 
-        // A simple heuristic: threshold ~ cbrt(n), then rounded to (2^k - 1).
-        int cbr = (int)cbrt((double)n);
-        int bt  = 32 - __builtin_clz(max(1, cbr));
+        // B-tree style repair of children[c] after an erase below it:
+        //   - an internal child left with one child is replaced by that child;
+        //   - a block under half of leaf_threshold merges with an adjacent block
+        //     when both fit in leaf_threshold, otherwise borrows to even them out.
+        void fix_underflow(int c, int leaf_threshold, NodeArena& arena) {
+            Node* ch = children[c];
+            if (!ch->is_block) {
+                if (ch->children.size() == 1) writable_child(c, arena);
+                return;
+            }
 
-        cfg_.leaf_threshold = (cfg_.leaf_threshold == -1) ? max(2, (1 << bt) - 1) : cfg_.leaf_threshold;
-        cfg_.rebuild_after_splits = (cfg_.rebuild_after_splits == -1) ? max(50, cfg_.leaf_threshold * 2)
-                                                                     : cfg_.rebuild_after_splits;
+            if (2 * ch->subtree_size >= leaf_threshold) return;
+            int left = c - 1, right = c + 1;
+            bool has_left  = left >= 0 && children[left]->is_block;
+            bool has_right = right < (int)children.size() && children[right]->is_block;
+            if (!has_left && !has_right) return;
+
+            int a = c, b = right;
+            if (!has_right || (has_left && children[left]->subtree_size < children[right]->subtree_size)) {
+                a = left;
+                b = c;
+            }
+            Node* x = writable_child(a, arena);
+            Node* y = writable_child(b, arena);
+            x->push(arena);
+            y->push(arena);
+
+            int total = x->subtree_size + y->subtree_size;
+            if (total <= leaf_threshold) {
+                x->values.insert(x->values.end(), y->values.begin(), y->values.end());
+                x->subtree_size = total;
+                x->pull();
+                arena.release(y);
+                children.erase(children.begin() + b);
+            } else {
+                int want = total / 2;
+                if (x->subtree_size < want) {
+                    int k = want - x->subtree_size;
+                    x->values.insert(x->values.end(), y->values.begin(), y->values.begin() + k);
+                    y->values.erase(y->values.begin(), y->values.begin() + k);
+                } else {
+                    int k = x->subtree_size - want;
+                    y->values.insert(y->values.begin(), x->values.end() - k, x->values.end());
+                    x->values.resize(want);
+                }
+                x->subtree_size = (int)x->values.size();
+                y->subtree_size = (int)y->values.size();
+                x->pull();
+                y->pull();
+            }
+            rebuild_prefix_sizes();
+        }
 
-        root_ = make_unique<Node>(n);
-        root_->build_skeleton(cfg_.leaf_threshold, *spf_sieve_, cfg_.max_spf);
+        // Cuts u after its first k elements; u itself becomes the left part. Along
+        // the cut path each node is split in two, the boundary children are
+        // repaired and single-child nodes are dropped.
+        static pair<Node*, Node*> split(Node* u, int k, int linear_cutoff, int leaf_threshold, NodeArena& arena) {
+            if (k <= 0) return {nullptr, u};
+            if (k >= u->subtree_size) return {u, nullptr};
+            u->push(arena);
+            if (u->is_block) {
+                Node* r = make_block(u->values.data() + k, u->subtree_size - k, arena);
+                u->values.resize(k);
+                u->subtree_size = k;
+                u->pull();
+                return {u, r};
+            }
 
-        int idx = 0;
-        root_->fill_from_array(a, idx);
+            int c = u->choose_child_by_index(k, linear_cutoff);
+            auto cut = split(u->writable_child(c, arena), k - u->prefix_sizes[c], linear_cutoff, leaf_threshold, arena);
+            Node* r = arena.make(0);
+            arena.attach_table(r);
+            if (cut.second) r->children.push_back(cut.second);
+            r->children.insert(r->children.end(), u->children.begin() + c + 1, u->children.end());
+            u->children.resize(c);
+            u->children.push_back(cut.first);
+            return {finish_cut(u, (int)u->children.size() - 1, leaf_threshold, arena),
+                    finish_cut(r, 0, leaf_threshold, arena)};
+        }
 
-        split_count_ = 0;
-    }
+        static Node* finish_cut(Node* u, int c, int leaf_threshold, NodeArena& arena) {
+            u->rebuild_prefix_sizes();
+            u->fix_underflow(c, leaf_threshold, arena);
+            u->subtree_size = u->prefix_sizes.back();
+            u->pull();
+            if (u->children.size() != 1) return u;
+            Node* only = u->children[0];
+            arena.release(u);
+            return only;
+        }
 
-    void rebuild() {
-        if (!root_) return;
-        vector<Agg> flat = to_vector();
-        build_from_array(flat);
-    }
+        // Hangs the shorter of a, b as the outermost child of the first node on the
+        // facing spine of the taller one whose children are no taller than it.
+        static Node* join(Node* a, Node* b, int leaf_threshold, NodeArena& arena) {
+            if (a->height == b->height) {
+                Node* kids[2] = {a, b};
+                Node* p = make_parent(kids, 2, arena);
+                p->fix_underflow(1, leaf_threshold, arena);
+                p->fix_underflow(0, leaf_threshold, arena);
+                p->pull();
+                if (p->children.size() != 1) return p;
+                Node* only = p->children[0];
+                arena.release(p);
+                return only;
+            }
 
-private:
-    Config cfg_;
-    unique_ptr<SmallestPrimeFactorSieve> spf_sieve_;
-    unique_ptr<Node> root_;
-    int split_count_ = 0;
+            bool append = a->height > b->height;
+            Node* top = append ? a : b;
+            Node* low = append ? b : a;
+            int added = low->subtree_size; // low may be merged away below
+            vector<Node*> path;
+            Node* u = top;
+            for (;;) {
+                u->push(arena);
+                int c = append ? (int)u->children.size() - 1 : 0;
+                if (u->children[c]->height <= low->height) break;
+                Node* next = u->writable_child(c, arena);
+                if (next->is_block || next->height <= low->height) break;
+                path.push_back(u);
+                u = next;
+            }
+            if (append) {
+                u->children.push_back(low);
+            } else {
+                u->children.insert(u->children.begin(), low);
+            }
+            u->rebuild_prefix_sizes();
+            u->subtree_size += added;
+            if (append) {
+                int c = (int)u->children.size() - 1;
+                u->fix_underflow(c, leaf_threshold, arena);
+                u->fix_underflow(c - 1, leaf_threshold, arena);
+            } else {
+                u->fix_underflow(1, leaf_threshold, arena);
+                u->fix_underflow(0, leaf_threshold, arena);
+            }
+            u->pull();
+            // Repeated joins keep widening the same spine node.
+            if (too_wide(u, leaf_threshold)) {
+                Node* fresh = rebuild_subtree(u, leaf_threshold, arena);
+                if (path.empty()) {
+                    top = fresh;
+                } else {
+                    Node* p = path.back();
+                    p->children[append ? (int)p->children.size() - 1 : 0] = fresh;
+                }
+                u = fresh;
+            }
+            for (int i = (int)path.size() - 1; i >= 0; --i) {
+                Node* p = path[i];
+                p->subtree_size += added;
+                p->shift_prefix_sizes(append ? (int)p->children.size() - 1 : 0, added);
+                p->pull();
+            }
+            return top;
+        }
+
+        // Keep blocks holding [T/2, T] values, pour the rest into blocks of T.
+        static void repack_blocks(vector<Node*>& blocks, int t, NodeArena& arena) {
+            int lo = max(1, t / 2);
+            BlockPacker packer(t);
+            packer.blocks.reserve(blocks.size());
+            for (Node* b : blocks) {
+                int sz = b->subtree_size;
+                if (!packer.open && lo <= sz && sz <= t) {
+                    packer.blocks.push_back(b);
+                    continue;
+                }
+                b = own(b, arena);
+                b->push(arena);
+                packer.add(b->values.data(), sz, arena);
+                arena.release(b);
+            }
+            packer.finish();
+            blocks.swap(packer.blocks);
+        }
+
+        // Drops one reference to u; the nodes it was the last owner of are freed.
+        static void release_subtree(Node* u, NodeArena& arena) {
+            if (--u->refs > 0) return;
+            arena.lock(u); // before its values go
+            if (u->is_block) {
+                Values().swap(u->values);
+            } else {
+                for (auto c : u->children) release_subtree(c, arena);
+            }
+            arena.release(u);
+        }
+
+        // Consumes one reference to u and hands every block under it (in order,
+        // with their own tags intact) to out, releasing internal nodes on the way.
+        // A shared internal node without tags is not copied: its children are
+        // borrowed instead.
+        static void release_into_blocks(Node* u, vector<Node*>& out, NodeArena& arena) {
+            if (u->is_block) {
+                out.push_back(u);
+                return;
+            }
+            if (u->refs > 1 && !u->reversed && u->lazy == Policy::LAZY_ID) {
+                --u->refs;
+                for (auto c : u->children) {
+                    ++c->refs;
+                    release_into_blocks(c, out, arena);
+                }
+                return;
+            }
+            u = own(u, arena);
+            u->push(arena);
+            for (auto c : u->children) release_into_blocks(c, out, arena);
+            arena.release(u);
+        }
+
+        // Appends elements l..r (1-based, clamped) to out without writing anything;
+        // pending lazies and reversals are applied to the copies.
+        void collect(int l, int r, int linear_cutoff, vector<Agg>& out) const {
+            l = max(l, 1);
+            r = min(r, subtree_size);
+            if (l > r) return;
+            size_t start = out.size();
+            if (is_block) {
+                int lo = reversed ? subtree_size - r : l - 1;
+                out.insert(out.end(), values.begin() + lo, values.begin() + lo + (r - l + 1));
+            } else {
+                int a = reversed ? subtree_size - r + 1 : l;
+                int b = reversed ? subtree_size - l + 1 : r;
+                int lc = choose_child_by_index(a, linear_cutoff);
+                int rc = choose_child_by_index(b, linear_cutoff);
+                for (int i = lc; i <= rc; ++i) {
+                    children[i]->collect(a - prefix_sizes[i], b - prefix_sizes[i], linear_cutoff, out);
+                }
+            }
+            if (lazy != Policy::LAZY_ID) BlockOps<Policy>::apply(out.data() + start, (int)(out.size() - start), lazy);
+            if (reversed) reverse(out.begin() + start, out.end());
+        }
+    };
+
+    // Pours values, in order, into consecutive blocks of exactly t values
+    // (the last one may be shorter once finish() is called).
+    struct BlockPacker {
+        int t = 2;
+        vector<Node*> blocks;
+        Node* open = nullptr;
+
+        BlockPacker() = default;
+        explicit BlockPacker(int t_) : t(t_) {}
+
+        void add(const Agg* a, int n, NodeArena& arena) {
+            for (int pos = 0; pos < n;) {
+                if (!open) {
+                    open = arena.make(0);
+                    open->is_block = true;
+                    open->values.reserve(t);
+                }
+                int take = min(n - pos, t - (int)open->values.size());
+                open->values.insert(open->values.end(), a + pos, a + pos + take);
+                pos += take;
+                if ((int)open->values.size() == t) close_open();
+            }
+        }
+
+        void finish() {
+            if (open) close_open();
+        }
+
+    private:
+        void close_open() {
+            open->subtree_size = (int)open->values.size();
+            open->pull();
+            blocks.push_back(open);
+            open = nullptr;
+        }
+    };
+
+    // Walks a frozen tree in order and pours it into a BlockPacker, like
+    // rebuild_subtree: blocks of a reasonable size are linked as they are, and
+    // only the others (and subtrees under a tag) are copied, tags applied. It
+    // reads the frozen nodes and nothing else, refs included, so it may run on
+    // another thread while the live tree copies on write around them.
+    struct FrozenWalk {
+        BlockPacker packer;
+        vector<Node*> linked; // frozen blocks now in packer.blocks; each still owes a reference
+        vector<pair<const Node*, int>> stack; // node, next child (or next value to copy)
+        vector<Agg> scratch;
+        // Stacking cursor: packer.blocks holds the level being grouped, [0, parent)
+        // its new parents so far and [child, end) the nodes not grouped yet.
+        int parents = 0, parent = 0, child = 0;
+
+        FrozenWalk() = default;
+        FrozenWalk(const Node* root, int t) : packer(t) {
+            if (root) stack.push_back({root, 0});
+        }
+
+        bool done() const { return stack.empty(); }
+
+        // About budget units of work: a copied value, a linked block or a visited node each.
+        void run(int budget, int linear_cutoff, NodeArena& arena) {
+            int t = packer.t;
+            int lo = max(1, t / 2);
+            while (budget > 0 && !stack.empty()) {
+                auto& [u, next] = stack.back();
+                if (u->is_block || u->reversed || u->lazy != Policy::LAZY_ID) {
+                    int take = min(budget, u->subtree_size - next);
+                    scratch.clear();
+                    u->collect(next + 1, next + take, linear_cutoff, scratch);
+                    packer.add(scratch.data(), take, arena);
+                    next += take;
+                    budget -= take;
+                    if (next == u->subtree_size) stack.pop_back();
+                    continue;
+                }
+                if (next == (int)u->children.size()) {
+                    stack.pop_back();
+                    continue;
+                }
+                Node* c = u->children[next++];
+                --budget;
+                int sz = c->subtree_size;
+                if (c->is_block && !packer.open && lo <= sz && sz <= t) {
+                    packer.blocks.push_back(c);
+                    linked.push_back(c);
+                } else {
+                    stack.push_back({c, 0});
+                }
+            }
+        }
+
+        // Once done(), stacks the skeleton over everything staged the way
+        // Node::stack_levels does, one parent at a time for about budget units
+        // (a grouped node each). Returns its root when the last level is built.
+        Node* finish(int budget, NodeArena& arena) {
+            packer.finish();
+            auto& level = packer.blocks;
+            while (budget > 0 && level.size() > 1) {
+                int m = (int)level.size();
+                if (parents == 0) parents = (m + packer.t - 1) / packer.t;
+                int cnt = m / parents + (parent < m % parents ? 1 : 0);
+                level[parent++] = Node::make_parent(level.data() + child, cnt, arena);
+                child += cnt;
+                budget -= cnt;
+                if (parent == parents) {
+                    level.resize(parents);
+                    parents = parent = child = 0;
+                }
+            }
+            if (level.size() != 1) return nullptr;
+            Node* root = level[0];
+            level.clear();
+            return root;
+        }
+
+        // Hands back what is staged but not under a finished root yet.
+        void release_staged(NodeArena& arena) {
+            auto& level = packer.blocks;
+            for (int i = 0; i < parent; ++i) Node::release_subtree(level[i], arena);
+            for (size_t i = child; i < level.size(); ++i) Node::release_subtree(level[i], arena);
+            if (packer.open) Node::release_subtree(packer.open, arena);
+        }
+    };
+
+    // ---------- Incremental / background rebuild ----------
+    // A rebuild starts by freezing the tree: one more reference on the root, as
+    // a snapshot takes, so the live tree copies on write from then on and the
+    // frozen one stays as it was. Every mutation is logged with the positions
+    // it had. A FrozenWalk relinks the frozen blocks under a new skeleton; the
+    // linked blocks then take their reference, the log is replayed on the new
+    // root a few entries per operation, and the roots are swapped. The old live
+    // root and the frozen one are retired a slice per operation.
+    //
+    // With max_rebuild_work_per_op = K > 0 the walk and the stacking of the
+    // new skeleton run on the caller's thread, about K units per operation. With background_rebuild it runs on a
+    // worker thread into the worker's own arena, which is adopted once it is
+    // done. Either way the caller never copies the sequence; it pays a path
+    // copy for the first write under each frozen node instead.
+    // In both modes insert_at leaves an overgrown subtree for the next rebuild
+    // rather than rebuilding it on the spot, and a replay that takes the new
+    // root over budget schedules another rebuild; see the Config note for the
+    // calls that still rebuild at once.
+    struct LoggedOp {
+        enum Kind { PointSet, RangeApply, Insert, Erase, Reverse } kind;
+        int l, r;
+        Agg value;
+        Lazy delta;
+    };
+
+    struct BufferedApply {
+        int l, r; // clamped to the tree
+        Lazy delta;
+    };
+
+    struct BackgroundBuild {
+        FrozenWalk walk;
+        NodeArena arena;
+        future<Node*> result; // declared last: destroying it joins the worker first
+
+        BackgroundBuild(const Node* frozen, int slab_nodes, int t) : walk(frozen, max(2, t)), arena(slab_nodes) {
+            arena.set_fanout(t);
+        }
+    };
+
+    struct PendingRebuild {
+        bool active = false;
+        Node* frozen = nullptr;  // the tree as it was when the rebuild began
+        FrozenWalk walk;         // incremental mode; background mode hands it over when done
+        unique_ptr<BackgroundBuild> job;
+        Node* fresh = nullptr;   // root of the new tree once everything is staged
+        size_t counted = 0;      // walk.linked[0, counted) hold their reference
+        vector<LoggedOp> log;
+        size_t replayed = 0;
+        bool rebuild_again = false; // the replay took fresh over its height budget
+    };
+
+public:
+    // Read-only view of the sequence as it was when snapshot() was called. It
+    // shares every node with the tree, which copies a node the first time it
+    // writes below a shared one, so taking a snapshot is O(1) and later writes
+    // pay only for the paths they touch.
+    // Any thread may read a snapshot while the tree is written, but copying
+    // and destroying one change node reference counts (and the tree's arena,
+    // unless split_at or concat shared it) without a lock. Do those on the
+    // thread that writes the tree (or while nothing writes it), and while no
+    // concurrent_query runs.
+    class Snapshot {
+    public:
+        Snapshot() = default;
+        Snapshot(const Snapshot& o) : Snapshot(o.root_, o.linear_cutoff_, o.arena_, o.linked_arenas_) {}
+        Snapshot(Snapshot&& o) noexcept { swap(o); }
+        Snapshot& operator=(Snapshot o) noexcept {
+            swap(o);
+            return *this;
+        }
+        ~Snapshot() {
+            if (!root_) return;
+            // Nothing else holds the nodes once the arena is this snapshot's alone.
+            if (arena_.use_count() > 1 || !linked_arenas_.empty()) {
+                Node::release_subtree(root_, *arena_);
+                arena_->unlock_all(); // as in release_nodes()
+            }
+            if (holds_arena_) arena_->drop_holder();
+            for (auto& a : linked_arenas_) a->drop_holder();
+        }
+
+        int size() const { return root_ ? root_->subtree_size : 0; }
+
+        // 1-indexed
+        Agg range_query(int l, int r) const {
+            return root_ ? root_->read(l, r, linear_cutoff_) : Policy::AGG_ID;
+        }
+
+        vector<Agg> to_vector() const {
+            vector<Agg> out;
+            if (!root_) return out;
+            out.reserve(root_->subtree_size);
+            root_->collect(1, root_->subtree_size, linear_cutoff_, out);
+            return out;
+        }
+
+    private:
+        friend class BahnasyTree;
+
+        Snapshot(Node* root, int linear_cutoff, shared_ptr<NodeArena> arena, vector<shared_ptr<NodeArena>> linked)
+            : root_(root), linear_cutoff_(linear_cutoff), arena_(std::move(arena)), linked_arenas_(std::move(linked)) {
+            if (!root_) return;
+            ++root_->refs;
+            // Counted as a holder wherever another tree may write meanwhile, so
+            // dropping this snapshot stays under the lock after its tree is gone.
+            holds_arena_ = arena_->between_trees();
+            if (holds_arena_) arena_->add_holder();
+            for (auto& a : linked_arenas_) a->add_holder();
+        }
+
+        void swap(Snapshot& o) noexcept {
+            std::swap(root_, o.root_);
+            std::swap(linear_cutoff_, o.linear_cutoff_);
+            arena_.swap(o.arena_);
+            linked_arenas_.swap(o.linked_arenas_);
+            std::swap(holds_arena_, o.holds_arena_);
+        }
+
+        Node* root_ = nullptr;
+        int linear_cutoff_ = 0;
+        shared_ptr<NodeArena> arena_;                 // keep the shared nodes alive after
+        vector<shared_ptr<NodeArena>> linked_arenas_; // the tree itself is gone
+        bool holds_arena_ = false;                    // counted in arena_'s holders
+    };
+
+    Snapshot snapshot() {
+        auto guard = exclusive();
+        flush_applies();
+        return Snapshot(root_, cfg_.linear_search_cutoff, arena_, linked_arenas_);
+    }
+
+private:
+    // An empty tree on another tree's sieve, for split_at.
+    BahnasyTree(const Config& cfg, shared_ptr<SmallestPrimeFactorSieve> sieve, shared_ptr<NodeArena> arena)
+        : cfg_(cfg), spf_sieve_(std::move(sieve)), arena_(std::move(arena)) {
+        if (cfg_.concurrent_reads) {
+            arena_->track_writes(true);
+            epochs_ = make_unique<ReaderEpochs>();
+        }
+    }
+
+    // Brackets a public write when concurrent_reads is on (a no-op otherwise).
+    // Nodes the write touches stay locked in the arena until the outermost scope
+    // ends; a whole-tree write also holds tree_version_ odd. On exit the root is
+    // published first, so a reader never sees an unlocked node under a stale root.
+    // Block buffers freed meanwhile are retired (a scope nested in another
+    // tree's, as in concat, keeps that tree's list) and reclaimed at the end.
+    class WriteScope {
+    public:
+        WriteScope(BahnasyTree& t, bool whole) : t_(t) {
+            if (!t_.cfg_.concurrent_reads) return;
+            if (++t_.write_depth_ == 1) {
+                saved_target_ = retire_target();
+                if (!saved_target_) retire_target() = t_.epochs_->retire_list();
+            }
+            unsigned tv = t_.tree_version_.load(memory_order_relaxed);
+            if (whole && !(tv & 1)) {
+                t_.tree_version_.store(tv + 1, memory_order_relaxed);
+                atomic_thread_fence(memory_order_release);
+            }
+        }
+        ~WriteScope() {
+            if (!t_.cfg_.concurrent_reads || --t_.write_depth_ > 0) return;
+            t_.published_root_.store(t_.root_, memory_order_release);
+            if (t_.arena_) t_.arena_->unlock_all();
+            unsigned tv = t_.tree_version_.load(memory_order_relaxed);
+            if (tv & 1) t_.tree_version_.store(tv + 1, memory_order_release);
+            retire_target() = saved_target_;
+            t_.epochs_->reclaim();
+        }
+        WriteScope(const WriteScope&) = delete;
+        WriteScope& operator=(const WriteScope&) = delete;
+
+    private:
+        BahnasyTree& t_;
+        vector<void*>* saved_target_ = nullptr;
+    };
+
+    // concurrent_writes: every call but point_set and range_apply holds the tree
+    // exclusively. It waits for the latched writes in flight to drain, then redoes
+    // the aggregates they left stale.
+    unique_lock<shared_mutex> exclusive() {
+        auto lock = hold();
+        if (root_ && lock) Node::refresh_stale(root_);
+        return lock;
+    }
+
+    // The same lock for the const reads, which write nothing and leave the
+    // stale aggregates to the next exclusive call.
+    unique_lock<shared_mutex> hold() const {
+        if (!cfg_.concurrent_writes) return {};
+        return unique_lock<shared_mutex>(writers_);
+    }
+
+    // point_set and range_apply share the tree and latch nodes hand over hand from
+    // the root, so writes to different subtrees only meet on the levels above them.
+    // Sizes do not change, so nothing is split, merged or rebuilt under the shared
+    // lock. A rebuild that logs writes, or a root shared with a snapshot, sends
+    // the call down the exclusive path (false).
+    bool latchable() const { return !pending_.active && root_ && root_->refs == 1; }
+
+    bool point_set_shared(int idx, Agg value) {
+        shared_lock<shared_mutex> lock(writers_);
+        if (!latchable()) return false;
+        if (idx >= 1 && idx <= root_->subtree_size) {
+            root_->latch();
+            root_->point_set_latched(idx, value, cfg_.linear_search_cutoff, *arena_);
+        }
+        return true;
+    }
+
+    bool apply_shared(int l, int r, Lazy delta) {
+        shared_lock<shared_mutex> lock(writers_);
+        if (!latchable()) return false;
+        l = max(l, 1);
+        r = min(r, root_->subtree_size);
+        if (l <= r) {
+            root_->latch();
+            root_->range_apply_latched(l, r, delta, cfg_.linear_search_cutoff, *arena_);
+        }
+        return true;
+    }
+
+    // Smaller batches are not worth waking the pool for.
+    static constexpr int kParallelBatchMin = 256;
+
+    // Parallel batches fork at the root, and one level deeper at a time until
+    // there are a few subtrees per thread to even out the load (stealing does
+    // the rest); never below the parents of the blocks.
+    int fork_depth() const {
+        long long width = root_->children.size();
+        int depth = 1;
+        while (width < 4LL * cfg_.batch_threads && depth < root_->height - 1) {
+            width *= max(2, cfg_.leaf_threshold);
+            ++depth;
+        }
+        return depth;
+    }
+
+    // Restores the root invariants after split/concat and re-arms the rebuild triggers.
+    void after_reshape() {
+        if (root_) collapse_root(root_);
+        reset_rebuild_counters();
+        if (root_ && root_->height > Node::height_budget(root_->subtree_size, cfg_.leaf_threshold, cfg_.height_slack))
+            start_rebuild();
+    }
+
+    // Returns true when the root outgrew its height budget. When rebuilds run
+    // in slices, a subtree over its own budget is not rebuilt on the spot (that
+    // is as much work as the subtree is big); the root check starts a sliced
+    // rebuild instead once the whole tree is over.
+    bool insert_into(Node*& root, int idx, Agg value) {
+        if (!root) {
+            root = Node::make_block(&value, 1, *arena_);
+            return false;
+        }
+        root = Node::own(root, *arena_);
+        root->insert_at(
+                idx, value,
+                cfg_.linear_search_cutoff,
+                cfg_.leaf_threshold,
+                *spf_sieve_,
+                cfg_.max_spf,
+                rebuilds_in_slices() ? INT_MAX / 2 : cfg_.height_slack,
+                *arena_
+        );
+        return root->height > Node::height_budget(root->subtree_size, cfg_.leaf_threshold, cfg_.height_slack);
+    }
+
+    void reverse_in(Node*& root, int l, int r) {
+        if (!root) return;
+        root = Node::own(root, *arena_);
+        root->range_reverse(l, r, cfg_.linear_search_cutoff, cfg_.leaf_threshold, *arena_);
+        if (Node::too_wide(root, cfg_.leaf_threshold)) root = Node::rebuild_subtree(root, cfg_.leaf_threshold, *arena_);
+    }
+
+    void erase_from(Node*& root, int idx) {
+        if (!root) return;
+        root = Node::own(root, *arena_);
+        root->erase_at(idx, cfg_.linear_search_cutoff, cfg_.leaf_threshold, *arena_);
+        if (root->subtree_size == 0) {
+            arena_->release(root);
+            root = nullptr;
+            return;
+        }
+        collapse_root(root);
+    }
+
+    // One pass over the blocks in order, cutting the sorted batch in between
+    // them, into a packer that lays out the new tree's blocks.
+    void merge_rebuild(const vector<pair<int, Agg>>& batch) {
+        vector<Node*> blocks;
+        Node::release_into_blocks(root_, blocks, *arena_);
+        int t = max(2, cfg_.leaf_threshold);
+        BlockPacker packer(t);
+        int k = (int)batch.size(), j = 0;
+        int pos = 1; // position of the next old element
+        for (Node* b : blocks) {
+            b = Node::own(b, *arena_);
+            b->push(*arena_);
+            int m = (int)b->values.size();
+            for (int i = 0; i < m;) {
+                while (j < k && batch[j].first <= pos) packer.add(&batch[j++].second, 1, *arena_);
+                int run = j < k ? min(m - i, batch[j].first - pos) : m - i;
+                packer.add(b->values.data() + i, run, *arena_);
+                i += run;
+                pos += run;
+            }
+            arena_->release(b);
+        }
+        for (; j < k; ++j) packer.add(&batch[j].second, 1, *arena_);
+        packer.finish();
+        root_ = Node::stack_levels(packer.blocks, t, *arena_);
+        reset_rebuild_counters();
+    }
+
+    bool rebuilds_in_slices() const { return cfg_.background_rebuild || cfg_.max_rebuild_work_per_op > 0; }
+
+    void start_rebuild() {
+        if (!rebuilds_in_slices()) {
+            rebuild();
+            return;
+        }
+        pending_ = PendingRebuild{};
+        pending_.active = true;
+        // Buffered applies stay out: they reach the fresh tree through the log.
+        pending_.frozen = root_;
+        ++root_->refs;
+        if (!cfg_.background_rebuild) {
+            pending_.walk = FrozenWalk(root_, max(2, cfg_.leaf_threshold));
+            return;
+        }
+        auto job = make_unique<BackgroundBuild>(root_, cfg_.arena_slab_nodes, cfg_.leaf_threshold);
+        BackgroundBuild* j = job.get();
+        int linear_cutoff = cfg_.linear_search_cutoff;
+        j->result = async(launch::async, [j, linear_cutoff]() {
+            j->walk.run(INT_MAX, linear_cutoff, j->arena);
+            return j->walk.finish(INT_MAX, j->arena);
+        });
+        pending_.job = std::move(job);
+    }
+
+    // Rebuild work done per operation (background mode may leave K at 0).
+    int rebuild_slice() const {
+        return cfg_.max_rebuild_work_per_op > 0 ? cfg_.max_rebuild_work_per_op : 4096;
+    }
+
+    // Called before a mutation reaches the live tree; positions are clamped
+    // to it the way the operation itself clamps them.
+    void log_mutation(LoggedOp op) {
+        int n = size();
+        switch (op.kind) {
+            case LoggedOp::Insert:
+                op.l = op.r = max(1, min(op.l, n + 1));
+                break;
+            case LoggedOp::Erase:
+            case LoggedOp::PointSet:
+                if (op.l < 1 || op.l > n) return;
+                break;
+            case LoggedOp::RangeApply:
+                op.l = max(op.l, 1);
+                op.r = min(op.r, n);
+                if (op.l > op.r) return;
+                break;
+            case LoggedOp::Reverse:
+                op.l = max(op.l, 1);
+                op.r = min(op.r, n);
+                if (op.l >= op.r) return;
+                break;
+        }
+        pending_.log.push_back(op);
+    }
+
+    void replay(const LoggedOp& op, Node*& root) {
+        switch (op.kind) {
+            case LoggedOp::PointSet:
+                if (root) root->point_set(op.l, op.value, cfg_.linear_search_cutoff, *arena_);
+                break;
+            case LoggedOp::RangeApply:
+                if (root) root->range_apply(op.l, op.r, op.delta, cfg_.linear_search_cutoff, *arena_);
+                break;
+            case LoggedOp::Insert:
+                // Rebuilding the fresh root here would be one unbounded step; it
+                // gets another sliced rebuild once it is swapped in instead.
+                if (insert_into(root, op.l, op.value)) pending_.rebuild_again = true;
+                break;
+            case LoggedOp::Erase:
+                erase_from(root, op.l);
+                break;
+            case LoggedOp::Reverse:
+                reverse_in(root, op.l, op.r);
+                break;
+        }
+    }
+
+    void step_rebuild() {
+        if (!retired_.empty()) drain_retired(rebuild_slice());
+        if (!pending_.active) return;
+        if (!root_) {
+            abort_rebuild();
+            return;
+        }
+        int budget = rebuild_slice();
+        int t = max(2, cfg_.leaf_threshold);
+
+        if (pending_.job) {
+            if (pending_.job->result.wait_for(chrono::seconds(0)) != future_status::ready) return;
+            pending_.fresh = pending_.job->result.get();
+            arena_->adopt(pending_.job->arena);
+            pending_.walk = std::move(pending_.job->walk);
+            pending_.job.reset();
+            return;
+        }
+
+        if (!pending_.fresh) {
+            if (!pending_.walk.done()) pending_.walk.run(budget, cfg_.linear_search_cutoff, *arena_);
+            else pending_.fresh = pending_.walk.finish(budget, *arena_);
+            return;
+        }
+
+        // The linked blocks are shared from here on; the replay below must see that.
+        auto& linked = pending_.walk.linked;
+        if (pending_.counted < linked.size()) {
+            for (int quota = budget; quota > 0 && pending_.counted < linked.size(); --quota)
+                ++linked[pending_.counted++]->refs;
+            return;
+        }
+
+        // A replayed operation costs about one block of work; draining at least two
+        // per call guarantees progress, since every call can append one entry.
+        for (int quota = max(2, budget / t); quota > 0 && pending_.replayed < pending_.log.size(); --quota) {
+            replay(pending_.log[pending_.replayed++], pending_.fresh);
+        }
+        if (pending_.replayed < pending_.log.size()) return;
+
+        // The old trees are handed back to the arena a slice per operation as well.
+        retired_.push_back(root_);
+        retired_.push_back(pending_.frozen);
+        root_ = pending_.fresh;
+        bool again = pending_.rebuild_again;
+        pending_ = PendingRebuild{};
+        if (root_) reset_rebuild_counters();
+        if (root_ && again) start_rebuild();
+    }
+
+    void drain_retired(int budget) {
+        while (budget > 0 && !retired_.empty()) {
+            Node* u = retired_.back();
+            retired_.pop_back();
+            --budget;
+            if (--u->refs > 0) continue; // still part of a snapshot
+            arena_->lock(u);
+            if (u->is_block) {
+                budget -= u->subtree_size;
+                Values().swap(u->values);
+            } else {
+                budget -= (int)u->children.size();
+                retired_.insert(retired_.end(), u->children.begin(), u->children.end());
+            }
+            arena_->release(u);
+        }
+    }
+
+    // Keeps an arena that holds some of this tree's nodes alive; a tree other
+    // than its owner may now free nodes into it.
+    void link_arena(const shared_ptr<NodeArena>& a) {
+        if (a == arena_ || find(linked_arenas_.begin(), linked_arenas_.end(), a) != linked_arenas_.end()) return;
+        a->add_holder();
+        linked_arenas_.push_back(a);
+    }
+
+    // Everything this tree holds a reference to: the root, retired nodes and
+    // a half-built replacement. Leaves the tree empty.
+    void release_nodes() {
+        if (!arena_) return; // moved from
+        if (arena_.use_count() == 1 && linked_arenas_.empty()) {
+            // The arena dies with this tree and nothing else holds its nodes:
+            // they go with its slabs, unwalked.
+            pending_ = PendingRebuild{}; // joins a background worker first
+            retired_.clear();
+            root_ = nullptr;
+            published_root_.store(nullptr, memory_order_release);
+            return;
+        }
+        if (pending_.active) abort_rebuild();
+        drain_retired(INT_MAX);
+        if (root_) Node::release_subtree(root_, *arena_);
+        root_ = nullptr;
+        published_root_.store(nullptr, memory_order_release);
+        // No write is open to publish what that locked, and the nodes may belong
+        // to an arena that dies with this tree.
+        arena_->unlock_all();
+    }
+
+    // This tree frees nothing into its arenas from now on.
+    void release_arenas() {
+        if (arena_) arena_->drop_holder();
+        for (auto& a : linked_arenas_) a->drop_holder();
+    }
+
+    void abort_rebuild() {
+        pending_.job.reset(); // waits for the worker; its nodes die with its arena
+        // Whatever holds a linked block takes it over from the frozen tree first.
+        auto& linked = pending_.walk.linked;
+        for (; pending_.counted < linked.size(); ++pending_.counted) ++linked[pending_.counted]->refs;
+        if (pending_.fresh) Node::release_subtree(pending_.fresh, *arena_);
+        pending_.walk.release_staged(*arena_);
+        if (pending_.frozen) Node::release_subtree(pending_.frozen, *arena_);
+        pending_ = PendingRebuild{};
+    }
+
+    void build_from_array(const vector<Agg>& a) {
+        int n = (int)a.size();
+        if (n == 0) {
+            root_ = nullptr;
+            return;
+        }
+
+        // A simple heuristic: threshold ~ cbrt(n), then rounded to (2^k - 1).
+        int cbr = (int)cbrt((double)n);
+        int bt  = 32 - __builtin_clz(max(1, cbr));
+
+        cfg_.leaf_threshold = (cfg_.leaf_threshold == -1) ? max(2, (1 << bt) - 1) : cfg_.leaf_threshold;
+        arena_->set_fanout(cfg_.leaf_threshold);
+
+        root_ = Node::build_balanced(a.data(), n, cfg_.leaf_threshold, *arena_);
+        reset_rebuild_counters();
+    }
+
+    void reset_rebuild_counters() {
+        erase_count_ = 0;
+        // Merges keep the depth in check while erasing; the counter only re-packs the tree
+        // once it lost half of its elements, which keeps the rebuild O(1) amortized per erase.
+        erase_budget_ = (cfg_.rebuild_after_erases == -1) ? max(50, size() / 2) : cfg_.rebuild_after_erases;
+    }
+
+    void apply_now(int l, int r, Lazy delta) {
+        if (pending_.active) log_mutation({LoggedOp::RangeApply, l, r, Policy::AGG_ID, delta});
+        writable_root()->range_apply(l, r, delta, cfg_.linear_search_cutoff, *arena_);
+    }
+
+    // A burst of range_apply on the same range costs one descent: the update is
+    // composed into a buffered one with the same bounds, unless an overlapping
+    // update sits between them (tags need not commute). The buffer is applied in
+    // order when it fills, before a point_set that overlaps it, and before any
+    // operation that moves positions; range_query folds it into its result.
+    void buffer_apply(int l, int r, Lazy delta) {
+        for (int i = (int)apply_buffer_.size() - 1; i >= 0; --i) {
+            BufferedApply& e = apply_buffer_[i];
+            if (e.l == l && e.r == r) {
+                e.delta = Policy::compose(e.delta, delta);
+                return;
+            }
+            if (e.l <= r && l <= e.r) break;
+        }
+        if ((int)apply_buffer_.size() >= cfg_.apply_buffer_size) flush_applies();
+        apply_buffer_.push_back({l, r, delta});
+    }
+
+    void flush_applies() {
+        for (const BufferedApply& e : apply_buffer_) apply_now(e.l, e.r, e.delta);
+        apply_buffer_.clear();
+    }
+
+    bool buffered_over(int l, int r) const {
+        for (const BufferedApply& e : apply_buffer_) {
+            if (e.l <= r && l <= e.r) return true;
+        }
+        return false;
+    }
+
+    void flush_applies_over(int l, int r) {
+        if (buffered_over(l, r)) flush_applies();
+    }
+
+    // Writers go through here: a root shared with a snapshot is copied first.
+    Node* writable_root() { return root_ = Node::own(root_, *arena_); }
+
+    // A root left with a single child only adds a level.
+    void collapse_root(Node*& root) {
+        while (!root->is_block && root->children.size() == 1) {
+            root->push(*arena_);
+            Node* only = Node::own(root->children[0], *arena_);
+            arena_->release(root);
+            root = only;
+        }
+    }
+
+    // Rebuild without flattening: internal nodes go back to the arena, blocks of a
+    // reasonable size are relinked as they are, only the others are re-cut, and a
+    // fresh balanced skeleton is stacked on top (reusing the released nodes).
+    void rebuild() {
+        if (!root_) return;
+        root_ = Node::rebuild_subtree(root_, cfg_.leaf_threshold, *arena_);
+        reset_rebuild_counters();
+    }
+
+private:
+    Config cfg_;
+    shared_ptr<SmallestPrimeFactorSieve> spf_sieve_;
+    shared_ptr<NodeArena> arena_;
+    vector<shared_ptr<NodeArena>> linked_arenas_; // keep nodes taken over by concat alive
+    Node* root_ = nullptr;
+    int erase_count_ = 0;
+    int erase_budget_ = 0;
+    PendingRebuild pending_;
+    vector<Node*> retired_;
+    vector<BufferedApply> apply_buffer_;
+    unique_ptr<WorkStealingPool> batch_pool_; // batch_threads > 1: made by the first large batch
+
+    // concurrent_reads: what readers start from (see WriteScope).
+    atomic<Node*> published_root_{nullptr};
+    atomic<unsigned> tree_version_{0};
+    int write_depth_ = 0;
+    unique_ptr<ReaderEpochs> epochs_; // block buffers the writers freed, held for the readers
+
+    mutable shared_mutex writers_; // concurrent_writes: shared by latched writes
+};
+
+// ---------- Flat-combining front end ----------
+// Any number of threads post operations; one combiner thread owns the tree and
+// runs them. Every posting thread holds its own ring of request slots from
+// first use until it exits, so posting is a plain store into memory nobody
+// else writes, with no allocation and no lock handed between producers. A
+// ring let go by an exiting thread goes to the next thread that needs one.
+// The combiner sweeps all rings, and runs each stretch of queries, applies
+// and point sets as one apply_batch, composing back-to-back applies on the
+// same range first. Every thread sees its own operations in the order it
+// posted them; query() waits for its answer, range_query() answers through a
+// future, and the other operations return at once (unless the thread's ring
+// is full).
+
+template <class Policy>
+class ConcurrentBahnasyTree {
+public:
+    using Tree   = BahnasyTree<Policy>;
+    using Agg    = typename Policy::Agg;
+    using Lazy   = typename Policy::Lazy;
+    using Config = typename Tree::Config;
+
+    explicit ConcurrentBahnasyTree(const vector<Agg>& initial = {}, Config cfg = {})
+        : tree_(initial, single_threaded(cfg)), combiner_([this] { combine_loop(); }) {}
+
+    // Runs whatever was posted before, then stops the combiner.
+    ~ConcurrentBahnasyTree() {
+        {
+            lock_guard<mutex> lk(wake_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        combiner_.join();
+    }
+
+    ConcurrentBahnasyTree(const ConcurrentBahnasyTree&) = delete;
+    ConcurrentBahnasyTree& operator=(const ConcurrentBahnasyTree&) = delete;
+
+    // 1-indexed. Waits for the combiner; nothing is allocated.
+    Agg query(int l, int r) {
+        Ring& g = my_ring();
+        uint32_t t = post(g, Request::Query, l, r, Policy::AGG_ID, Policy::LAZY_ID);
+        wait_for(g, t + 1);
+        return g.slots[t % kRingSize].answer;
+    }
+
+    // 1-indexed
+    future<Agg> range_query(int l, int r) {
+        Ring& g = my_ring();
+        Request& q = g.slots[reserve(g) % kRingSize];
+        future<Agg> f = q.result.emplace().get_future();
+        post(g, Request::Query, l, r, Policy::AGG_ID, Policy::LAZY_ID);
+        return f;
+    }
+
+    // 1-indexed
+    void range_apply(int l, int r, Lazy delta) { post(my_ring(), Request::Apply, l, r, Policy::AGG_ID, delta); }
+
+    // 1-indexed
+    void point_set(int idx, Agg value) { post(my_ring(), Request::PointSet, idx, idx, value, Policy::LAZY_ID); }
+
+    // 1-indexed insertion position
+    void insert_at(int idx, Agg value) { post(my_ring(), Request::Insert, idx, idx, value, Policy::LAZY_ID); }
+
+    // 1-indexed
+    void erase_at(int idx) { post(my_ring(), Request::Erase, idx, idx, Policy::AGG_ID, Policy::LAZY_ID); }
+
+    // Blocks until everything this thread posted so far has run.
+    void sync() {
+        Ring& g = my_ring();
+        wait_for(g, g.posted.load(memory_order_relaxed));
+    }
+
+private:
+    struct Request {
+        enum Kind { Query, Apply, PointSet, Insert, Erase } kind;
+        int l, r;
+        Agg value;
+        Lazy delta;
+        Agg answer;                     // Query: written before the ring's done moves past it
+        optional<promise<Agg>> result;  // range_query only
+    };
+
+    static constexpr uint32_t kRingSize = 64;
+
+    // One posting thread's requests: it writes slot posted % kRingSize and then
+    // bumps posted; the combiner runs [done, posted) and then bumps done. The
+    // tree lists its rings in a list that grows only when every ring is held,
+    // so it is as long as the most threads that ever posted at once. Requests a
+    // thread left behind when it exited still run; the next owner's follow them.
+    struct Ring : enable_shared_from_this<Ring> {
+        Request slots[kRingSize];
+        atomic<uint32_t> posted{0};
+        atomic<uint32_t> done{0};
+        atomic<bool> waiting{false}; // the owner gave up spinning on done
+        mutex wait_mutex;
+        condition_variable woken;
+        atomic<bool> held{false};    // some live thread posts here
+        atomic<thread::id> owner{};  // that thread, while held
+        Ring* next = nullptr;
+    };
+
+    // The rings a thread holds, across trees; it lets them go when it exits. A
+    // ring stays allocated until both its tree and the lease are done with it.
+    struct RingLease {
+        vector<shared_ptr<Ring>> rings;
+
+        void add(shared_ptr<Ring> g) {
+            // Rings of trees that are gone are only held here.
+            rings.erase(remove_if(rings.begin(), rings.end(), [](auto& r) { return r.use_count() == 1; }),
+                        rings.end());
+            rings.push_back(std::move(g));
+        }
+
+        ~RingLease() {
+            for (auto& g : rings) g->held.store(false, memory_order_release);
+        }
+    };
+
+    // The combiner is the tree's only user.
+    static Config single_threaded(Config cfg) {
+        cfg.concurrent_reads = false;
+        cfg.concurrent_writes = false;
+        return cfg;
+    }
+
+    // A thread remembers the ring of the last tree it posted to; trees are told
+    // apart by serial number, as an address may be reused by a later tree.
+    // Otherwise it looks for the ring it holds here, then for one nobody holds,
+    // and only then adds a ring.
+    Ring& my_ring() {
+        thread_local RingLease lease;
+        thread_local uint64_t cached_serial = 0;
+        thread_local Ring* cached = nullptr;
+        if (cached_serial == serial_) return *cached;
+        thread::id me = this_thread::get_id();
+        Ring* g = rings_.load(memory_order_acquire);
+        while (g && !(g->held.load(memory_order_acquire) && g->owner.load(memory_order_relaxed) == me)) g = g->next;
+        if (!g) {
+            for (g = rings_.load(memory_order_acquire); g; g = g->next) {
+                bool free = false;
+                if (g->held.compare_exchange_strong(free, true, memory_order_acquire)) break;
+            }
+            shared_ptr<Ring> owned;
+            if (g) {
+                owned = g->shared_from_this();
+            } else {
+                owned = make_shared<Ring>();
+                g = owned.get();
+                g->held.store(true, memory_order_relaxed);
+                {
+                    lock_guard<mutex> lk(rings_mutex_);
+                    ring_storage_.push_back(owned);
+                }
+                g->next = rings_.load(memory_order_relaxed);
+                while (!rings_.compare_exchange_weak(g->next, g, memory_order_release, memory_order_relaxed)) {}
+            }
+            g->owner.store(me, memory_order_relaxed);
+            lease.add(std::move(owned));
+        }
+        cached_serial = serial_;
+        cached = g;
+        return *g;
+    }
+
+    // The index of the next slot, once the combiner is done with what it held.
+    static uint32_t reserve(Ring& g) {
+        uint32_t t = g.posted.load(memory_order_relaxed);
+        wait_for(g, t - kRingSize + 1);
+        return t;
+    }
+
+    // Spins a little, then sleeps until the combiner moves done (the same
+    // handshake as sleeping_, per ring). On one core spinning only delays the
+    // combiner, so the wait sleeps at once.
+    static void wait_for(Ring& g, uint32_t done) {
+        static const int spins = thread::hardware_concurrency() > 1 ? 64 : 0;
+        auto reached = [&] { return (int32_t)(g.done.load(memory_order_seq_cst) - done) >= 0; };
+        for (int spin = 0; spin < spins; ++spin) {
+            if (reached()) return;
+            this_thread::yield();
+        }
+        g.waiting.store(true, memory_order_seq_cst);
+        {
+            unique_lock<mutex> lk(g.wait_mutex);
+            g.woken.wait(lk, reached);
+        }
+        g.waiting.store(false, memory_order_relaxed);
+    }
+
+    static void finish(Ring& g, uint32_t to) {
+        g.done.store(to, memory_order_seq_cst);
+        if (g.waiting.load(memory_order_seq_cst)) {
+            { lock_guard<mutex> lk(g.wait_mutex); }
+            g.woken.notify_one();
+        }
+    }
+
+    // The combiner sleeps only after a sweep found every ring empty, and says so
+    // first; a post that sees that wakes it.
+    uint32_t post(Ring& g, typename Request::Kind kind, int l, int r, Agg value, Lazy delta) {
+        uint32_t t = reserve(g);
+        Request& q = g.slots[t % kRingSize];
+        q.kind = kind;
+        q.l = l;
+        q.r = r;
+        q.value = value;
+        q.delta = delta;
+        g.posted.store(t + 1, memory_order_seq_cst);
+        if (sleeping_.load(memory_order_seq_cst)) {
+            { lock_guard<mutex> lk(wake_mutex_); }
+            wake_.notify_one();
+        }
+        return t;
+    }
+
+    // seq_cst against post(): see sleeping_.
+    bool any_posted() const {
+        for (Ring* g = rings_.load(memory_order_acquire); g; g = g->next)
+            if (g->posted.load(memory_order_seq_cst) != g->done.load(memory_order_relaxed)) return true;
+        return false;
+    }
+
+    void combine_loop() {
+        for (;;) {
+            pending_.clear();
+            taken_.clear();
+            for (Ring* g = rings_.load(memory_order_acquire); g; g = g->next) {
+                uint32_t from = g->done.load(memory_order_relaxed), to = g->posted.load(memory_order_acquire);
+                if (from == to) continue;
+                for (uint32_t t = from; t != to; ++t) pending_.push_back(&g->slots[t % kRingSize]);
+                taken_.emplace_back(g, to);
+            }
+            if (!pending_.empty()) {
+                run(pending_);
+                for (auto& [g, to] : taken_) finish(*g, to);
+                continue;
+            }
+            sleeping_.store(true, memory_order_seq_cst);
+            {
+                unique_lock<mutex> lk(wake_mutex_);
+                wake_.wait(lk, [&] { return stopping_ || any_posted(); });
+                if (stopping_ && !any_posted()) return;
+            }
+            sleeping_.store(false, memory_order_relaxed);
+        }
+    }
+
+    static void answer(Request* q, Agg res) {
+        q->answer = res;
+        if (q->result) {
+            q->result->set_value(res);
+            q->result.reset();
+        }
+    }
+
+    void run(const vector<Request*>& reqs) {
+        using BatchOp = typename Tree::BatchOp;
+        for (size_t i = 0; i < reqs.size();) {
+            Request* q = reqs[i];
+            if (q->kind == Request::Insert) {
+                tree_.insert_at(q->l, q->value);
+                ++i;
+                continue;
+            }
+            if (q->kind == Request::Erase) {
+                tree_.erase_at(q->l);
+                ++i;
+                continue;
+            }
+
+            // A stretch without position changes goes down in one batch.
+            size_t j = i;
+            ops_.clear();
+            asked_.clear();
+            for (; j < reqs.size() && reqs[j]->kind <= Request::PointSet; ++j) {
+                Request* o = reqs[j];
+                if (o->kind == Request::Apply) {
+                    if (!ops_.empty() && ops_.back().kind == BatchOp::RangeApply
+                        && ops_.back().l == o->l && ops_.back().r == o->r) {
+                        ops_.back().delta = Policy::compose(ops_.back().delta, o->delta);
+                    } else {
+                        ops_.push_back({BatchOp::RangeApply, o->l, o->r, Policy::AGG_ID, o->delta});
+                    }
+                } else if (o->kind == Request::PointSet) {
+                    ops_.push_back({BatchOp::PointSet, o->l, o->l, o->value, Policy::LAZY_ID});
+                } else {
+                    asked_.emplace_back(ops_.size(), o);
+                    ops_.push_back({BatchOp::RangeQuery, o->l, o->r, Policy::AGG_ID, Policy::LAZY_ID});
+                }
+            }
+            if (ops_.size() == 1) {
+                const BatchOp& op = ops_[0];
+                if (op.kind == BatchOp::RangeApply) tree_.range_apply(op.l, op.r, op.delta);
+                else if (op.kind == BatchOp::PointSet) tree_.point_set(op.l, op.value);
+                else answer(asked_[0].second, tree_.range_query(op.l, op.r));
+            } else {
+                vector<Agg> res = tree_.apply_batch(ops_);
+                for (auto& [k, o] : asked_) answer(o, res[k]);
+            }
+            i = j;
+        }
+    }
+
+    static inline atomic<uint64_t> next_serial_{1};
+
+    Tree tree_;
+    const uint64_t serial_ = next_serial_.fetch_add(1, memory_order_relaxed);
+    atomic<Ring*> rings_{nullptr}; // one per thread posting at once, newest first
+    mutex rings_mutex_;
+    vector<shared_ptr<Ring>> ring_storage_; // the tree's share of the rings in rings_
+    atomic<bool> sleeping_{false}; // set before the combiner's last look at the rings
+    mutex wake_mutex_;
+    condition_variable wake_;
+    bool stopping_ = false;
+    vector<Request*> pending_;                 // combiner only: the requests taken, ring by ring
+    vector<pair<Ring*, uint32_t>> taken_;      // combiner only: where each ring's done moves to
+    vector<typename Tree::BatchOp> ops_;       // combiner only: the stretch being batched
+    vector<pair<size_t, Request*>> asked_;     // combiner only: queries in ops_, by index
+    thread combiner_; // last: starts once everything above is built
 };
 
 } // namespace bahnasy
@@ -540,6 +3714,7 @@ int main() {
 }
 */
 
+#ifndef BAHNASY_NO_MAIN
 int main() {
     ios::sync_with_stdio(false);
     cin.tie(nullptr);
@@ -583,3 +3758,4 @@ int main() {
 
     return 0;
 }
+#endif